@@ -12,11 +12,83 @@
 #include <immintrin.h>
 #include <cassert>
 #include <iostream>
+#include <atomic>
+#include <cmath>
+#include <algorithm>
+#include <cerrno>
+#include <deque>
+#include <condition_variable>
+#include <type_traits>
+#include <sys/uio.h>
+#include <climits>
+#include <string_view>
+#include <glob.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
 
 namespace FastUniq {
     using u32 = uint32_t;
     using u64 = uint64_t;
 
+    // Execution strategy of the deduplication
+    enum class Engine {
+        Auto,           // BucketMutex or Partitioned depending on the estimated number of unique strings
+        BucketMutex,    // Per-bucket HashTable guarded by a shared_mutex
+        LockFree,       // Single open-addressing table with CAS inserts
+        Partitioned     // Lines are scattered by hash and each partition is deduplicated by one thread
+    };
+
+    struct Options {
+        Engine engine = Engine::Auto;
+        // Compare the strings whenever two hashes match, so that no string is lost
+        // by a hash collision. Engine::LockFree falls back to Engine::BucketMutex,
+        // and the hash width has no effect.
+        bool exact = false;
+        // Write the unique strings in the order of their first occurrence in the input,
+        // like `awk '!seen[$0]++'`. The file input always runs Engine::Partitioned.
+        bool ordered = false;
+        // Memory budget in bytes for the tables and the scattered lines of the file input
+        // (0: unlimited). Once the scattered lines exceed their share, they are spilled to
+        // temporary files in $TMPDIR (/tmp by default), and each partition is deduplicated
+        // in as many rounds as its table needs to stay within the budget. The file input
+        // always runs Engine::Partitioned when this is set.
+        u64 memoryLimit = 0;
+        // Pin the threads to the NUMA nodes, move the pages of the input to the node of
+        // the thread that starts on them, and spread the buckets of Engine::BucketMutex
+        // over the nodes by hash. Has no effect on a machine with a single node.
+        bool numa = false;
+        // Back the slot arrays of the tables and the input mapping with 2 MiB pages, which
+        // saves TLB misses on random probes into large tables. Arrays smaller than a huge
+        // page are allocated as usual.
+        bool hugePages = false;
+        // Estimate the number of unique strings with HyperLogLog over a sample of the
+        // input, and size the tables of Engine::BucketMutex and Engine::LockFree for it
+        // up front, so that they rarely grow while the threads insert
+        bool presize = false;
+        // Deduplicate on fields of each line instead of the whole line, like
+        // `sort -u -t SEP -k N,N`, and write the first line of each key in full. Fields are
+        // separated by fieldSeparator and numbered from 1, and the fields missing from a
+        // line are empty. keyFields is empty to use the whole line. Only the hashes of the
+        // keys are compared, so the exact mode has no effect with keyFields.
+        char fieldSeparator = '\t';
+        std::vector<u32> keyFields;
+        // Deduplicate JSON Lines on the values of these key paths, e.g. {"event_id"} or
+        // {"user.id", "ts"}, where a dot steps into a nested object. The values are
+        // compared as they are written (e.g. 1 and 1.0 differ), and a missing key is a
+        // value of its own. Keys are compared without unescaping, and arrays are not
+        // stepped into. Like keyFields, the exact mode has no effect, and both cannot be
+        // set together.
+        std::vector<std::string> jsonKeys;
+    };
+
+    // Width of the hashes kept in the tables, given as the template argument of the
+    // Uniquify functions. Hash128 makes collisions negligible without comparing strings,
+    // at the cost of twice the table memory. Engine::LockFree falls back to
+    // Engine::BucketMutex with Hash128.
+    struct Hash64 {};
+    struct Hash128 {};
+
     namespace Internal {
         using u8x32 = __m256i;
         using u8x16 = __m128i;
@@ -24,351 +96,4404 @@ namespace FastUniq {
         constexpr u32 PREFETCH_STRIDE = 16;
 
 
+        // Describes how a key type is stored in the tables. u64 keys are the plain
+        // 64-bit hashes of the lines.
+        template <typename Key>
+        struct KeyTraits;
+
+        template <>
+        struct KeyTraits<u64> {
+            using HashType = u64;
+            static constexpr u64 EMPTY = 0xffffffffffffffff;
+
+            // Memory owned by a table for the keys it stores
+            struct Storage {};
+
+            static inline u64 Make(u64 hash, const char* /* line */, u32 /* len */) {
+                return hash;
+            }
+
+            static inline u64 Hash(u64 key) {
+                return key;
+            }
+
+            static inline bool IsEmpty(u64 key) {
+                return key == EMPTY;
+            }
+
+            static inline bool Equal(u64 a, u64 b) {
+                return a == b;
+            }
+
+            static inline u64 Store(u64 key, Storage & /* storage */) {
+                return key;
+            }
+        };
+
+        bool LinesEqual(const char* a, const char* b, u32 len);
+
+        // All 128 bits of the AES state, used as the key by Hash128
+        struct WideHash {
+            u64 lo;
+            u64 hi;
+        };
+
+        template <>
+        struct KeyTraits<WideHash> {
+            using HashType = WideHash;
+            static constexpr WideHash EMPTY = {0xffffffffffffffff, 0xffffffffffffffff};
+
+            struct Storage {};
+
+            static inline WideHash Make(const WideHash &hash, const char* /* line */, u32 /* len */) {
+                return hash;
+            }
+
+            static inline u64 Hash(const WideHash &key) {
+                return key.lo;
+            }
+
+            static inline bool IsEmpty(const WideHash &key) {
+                return (key.lo & key.hi) == 0xffffffffffffffff;
+            }
+
+            static inline bool Equal(const WideHash &a, const WideHash &b) {
+                return ((a.lo ^ b.lo) | (a.hi ^ b.hi)) == 0;
+            }
+
+            static inline WideHash Store(const WideHash &key, Storage & /* storage */) {
+                return key;
+            }
+        };
+
+        // Reference to a line kept next to its hash. Used as the key by the exact mode
+        // and as the record scattered by the partitioned strategy.
+        // The pointer occupies the low 48 bits of ref and the length the high 16 bits.
+        // Lines too long for 16 bits store LONG_LINE and their length is recomputed,
+        // which stops at the newline MapInput and the stream blocks put after the input.
+        template <typename HashValue>
+        struct LineRecord {
+            HashValue hash;
+            u64 ref;
+
+            static constexpr u64 PTR_BITS = 48;
+            static constexpr u64 PTR_MASK = (1ULL << PTR_BITS) - 1;
+            static constexpr u32 LONG_LINE = 0xffff;
+
+            inline const char* Ptr() const {
+                return (const char*)(ref & PTR_MASK);
+            }
+
+            inline u32 Len() const {
+                u32 len = ref >> PTR_BITS;
+                if (len != LONG_LINE) return len;
+                return (const char*)rawmemchr(Ptr(), '\n') - Ptr();
+            }
+
+            static inline LineRecord Make(const HashValue &hash, const char* line, u32 len) {
+                u64 packedLen = std::min(len, (u32)LONG_LINE);
+                return {hash, (u64)line | (packedLen << PTR_BITS)};
+            }
+        };
+
+        using LineKey = LineRecord<u64>;
+
+        // Append-only copies of the lines stored in a table. Blocks are never moved,
+        // so the copies can be referenced by LineKeys.
+        class LineArena {
+            static constexpr u64 INIT_BLOCK_SIZE = 1 << 10;
+            static constexpr u64 MAX_BLOCK_SIZE = 1 << 20;
+            // LinesEqual may load up to 15 bytes past the end of a line
+            static constexpr u64 BLOCK_PADDING = 16;
+            std::vector<char*> blocks;
+            char* current = nullptr;
+            u64 remaining = 0;
+            u64 blockSize = INIT_BLOCK_SIZE;
+        public:
+            ~LineArena() {
+                for (char* block: blocks) {
+                    free(block);
+                }
+            }
+
+            const char* Copy(const char* line, u32 len) {
+                if (len + 1 > remaining) {
+                    remaining = std::max(blockSize, (u64)len + 1);
+                    blockSize = std::min(2 * blockSize, MAX_BLOCK_SIZE);
+                    current = (char*)malloc(remaining + BLOCK_PADDING);
+                    blocks.push_back(current);
+                }
+                memcpy(current, line, len);
+                current[len] = '\n';
+
+                const char* ret = current;
+                current += len + 1;
+                remaining -= len + 1;
+                return ret;
+            }
+        };
+
+        template <>
+        struct KeyTraits<LineKey> {
+
+            using HashType = u64;
+            static constexpr LineKey EMPTY = {0, 0};
+
+            // Lines are compared with the copy held by the table rather than with their
+            // first occurrence, which keeps the compared bytes close together in memory
+            using Storage = LineArena;
+
+            static inline LineKey Make(u64 hash, const char* line, u32 len) {
+                return LineKey::Make(hash, line, len);
+            }
+
+            static inline u64 Hash(const LineKey &key) {
+                return key.hash;
+            }
+
+            static inline bool IsEmpty(const LineKey &key) {
+                return key.ref == 0;
+            }
+
+            // Strings are compared only when the full hashes match
+            static inline bool Equal(const LineKey &a, const LineKey &b) {
+                if (a.hash != b.hash) return false;
+                if (a.ref == b.ref) return true;
+                u32 len = a.Len();
+                return len == b.Len() && LinesEqual(a.Ptr(), b.Ptr(), len);
+            }
+
+            static inline LineKey Store(const LineKey &key, LineArena &arena) {
+                u32 len = key.Len();
+                return Make(key.hash, arena.Copy(key.Ptr(), len), len);
+            }
+        };
+
+        // Key with a value which the table carries along but never looks at. Used by the
+        // count mode to find the counter of a line.
+        template <typename Key>
+        struct KeyValue {
+            Key key;
+            u64 value;
+        };
+
+        template <typename Key>
+        struct KeyTraits<KeyValue<Key>> {
+            using Inner = KeyTraits<Key>;
+            using HashType = typename Inner::HashType;
+            static constexpr KeyValue<Key> EMPTY = {Inner::EMPTY, 0};
+
+            using Storage = typename Inner::Storage;
+
+            static inline KeyValue<Key> Make(const HashType &hash, const char* line, u32 len) {
+                return {Inner::Make(hash, line, len), 0};
+            }
+
+            static inline u64 Hash(const KeyValue<Key> &key) {
+                return Inner::Hash(key.key);
+            }
+
+            static inline bool IsEmpty(const KeyValue<Key> &key) {
+                return Inner::IsEmpty(key.key);
+            }
+
+            static inline bool Equal(const KeyValue<Key> &a, const KeyValue<Key> &b) {
+                return Inner::Equal(a.key, b.key);
+            }
+
+            static inline KeyValue<Key> Store(const KeyValue<Key> &key, Storage &storage) {
+                return {Inner::Store(key.key, storage), key.value};
+            }
+        };
+
+        struct NumaNode {
+            int id;
+            cpu_set_t cpus;
+        };
+
+        // Node numbers above this are ignored
+        constexpr int NUMA_MAX_NODES = 1024;
+        constexpr u64 NUMA_PAGE_SIZE = 4096;
+
+        // Calls visit on every number of a sysfs list such as "0-3,8-11"
+        template <typename Visit>
+        void ParseSysList(const char* path, Visit visit) {
+            FILE* file = fopen(path, "r");
+            if (file == nullptr) return;
+            char buf[4096];
+            if (fgets(buf, sizeof(buf), file) != nullptr) {
+                char* p = buf;
+                while (*p >= '0' && *p <= '9') {
+                    long first = strtol(p, &p, 10), last = first;
+                    if (*p == '-') last = strtol(p + 1, &p, 10);
+                    for (long i = first; i <= last; i++) {
+                        visit(i);
+                    }
+                    if (*p == ',') p++;
+                }
+            }
+            fclose(file);
+        }
+
+        // The NUMA nodes having CPUs this process may run on, read once from sysfs.
+        // With fewer than two of them, options.numa has no effect.
+        const std::vector<NumaNode>& NumaNodes() {
+            static const std::vector<NumaNode> nodes = [] {
+                std::vector<NumaNode> nodes;
+                cpu_set_t allowed;
+                if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return nodes;
+                ParseSysList("/sys/devices/system/node/online", [&](long id) {
+                    if (id >= NUMA_MAX_NODES) return;
+                    NumaNode node{(int)id, {}};
+                    CPU_ZERO(&node.cpus);
+                    std::string path = "/sys/devices/system/node/node" + std::to_string(id) + "/cpulist";
+                    ParseSysList(path.data(), [&](long cpu) {
+                        if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) CPU_SET(cpu, &node.cpus);
+                    });
+                    if (CPU_COUNT(&node.cpus) > 0) nodes.push_back(node);
+                });
+                return nodes;
+            }();
+            return nodes;
+        }
+
+        bool NumaActive(bool numa) {
+            return numa && NumaNodes().size() > 1;
+        }
+
+        // Threads are given to the nodes in blocks of consecutive ids, the same way the
+        // input is given to the threads
+        u32 ThreadNode(u32 threadId, u32 threadNum) {
+            return (u64)threadId * NumaNodes().size() / threadNum;
+        }
+
+        // Sets the preferred node of the pages inside [addr, addr + len). Pages not touched
+        // yet are allocated there, and with move, pages already mapped are migrated there
+        // unless another process maps them too. Failures are ignored, as the placement
+        // only matters for speed.
+        void BindToNode(const void* addr, u64 len, int node, bool move = false) {
+            u64 beg = ((u64)addr + NUMA_PAGE_SIZE - 1) & ~(NUMA_PAGE_SIZE - 1);
+            u64 end = ((u64)addr + len) & ~(NUMA_PAGE_SIZE - 1);
+            if (beg >= end) return;
+            unsigned long mask[NUMA_MAX_NODES / (8 * sizeof(unsigned long))] = {};
+            mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+            syscall(SYS_mbind, beg, end - beg, MPOL_PREFERRED, mask, NUMA_MAX_NODES + 1, move ? MPOL_MF_MOVE : 0);
+        }
+
+        // Pins the calling thread to the CPUs of its node for the lifetime of the object,
+        // when numa is set
+        class NodeAffinity {
+            cpu_set_t saved;
+            bool pinned = false;
+        public:
+            NodeAffinity(bool numa, u32 threadId, u32 threadNum) {
+                if (!numa) return;
+                pinned = sched_getaffinity(0, sizeof(saved), &saved) == 0
+                    && sched_setaffinity(0, sizeof(cpu_set_t), &NumaNodes()[ThreadNode(threadId, threadNum)].cpus) == 0;
+            }
+
+            NodeAffinity(const NodeAffinity&) = delete;
+            NodeAffinity& operator=(const NodeAffinity&) = delete;
+
+            ~NodeAffinity() {
+                if (pinned) sched_setaffinity(0, sizeof(saved), &saved);
+            }
+        };
+
+        constexpr u64 HUGE_PAGE_SIZE = 2 << 20;
+
+        u64 HugePageRound(u64 bytes) {
+            return (bytes + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+        }
+
+        // Allocates the slots of a table, zeroed when zero is set. With hugePages, an array
+        // of at least a huge page gets its own mapping of huge pages: from the reserved
+        // hugetlbfs pool if it has enough pages, otherwise transparent huge pages on an
+        // aligned mapping. Such an array is always zeroed.
+        void* AllocSlots(u64 bytes, bool hugePages, bool zero = false) {
+            if (!hugePages || bytes < HUGE_PAGE_SIZE) {
+                void* slots = zero ? calloc(bytes, 1) : malloc(bytes);
+                if (slots == NULL) {
+                    perror("malloc");
+                    exit(1);
+                }
+                return slots;
+            }
+
+            u64 mapped = HugePageRound(bytes);
+            // 21 selects 2 MiB pages, 1 << 21
+            void* slots = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (21 << MAP_HUGE_SHIFT), -1, 0);
+            if (slots != MAP_FAILED) return slots;
+
+            // One more huge page leaves room to align the start
+            char* raw = (char*)mmap(nullptr, mapped + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (raw == MAP_FAILED) {
+                perror("mmap");
+                exit(1);
+            }
+            char* aligned = (char*)HugePageRound((u64)raw);
+            if (aligned > raw) munmap(raw, aligned - raw);
+            munmap(aligned + mapped, raw + HUGE_PAGE_SIZE - aligned);
+            madvise(aligned, mapped, MADV_HUGEPAGE);
+            return aligned;
+        }
+
+        void FreeSlots(void* slots, u64 bytes, bool hugePages) {
+            if (!hugePages || bytes < HUGE_PAGE_SIZE) {
+                free(slots);
+            } else {
+                munmap(slots, HugePageRound(bytes));
+            }
+        }
+
+        // Bytes readable past the end of a mapped input. The kernels may load up to 64
+        // bytes at a time past the last newline, and the first of them is a newline.
+        constexpr u64 INPUT_PADDING = 64;
+
+        inline u64 InputMappedSize(u64 fileSize) {
+            u64 pageSize = sysconf(_SC_PAGESIZE);
+            return (fileSize + INPUT_PADDING + pageSize - 1) / pageSize * pageSize;
+        }
+
+        // Maps an input file for reading, followed by a newline like the stream blocks,
+        // so that a last line without one ends within the mapping as well. The newline
+        // is written to the zero-filled tail of the last page of the file, or to the
+        // anonymous pages mapped after it. Unless numa is set, the pages are faulted in
+        // right away. With hugePages, the mapping is marked for huge pages first, which
+        // the kernel honors where the filesystem and the page cache support it.
+        // Returns MAP_FAILED on failure, and is undone by UnmapInput.
+        const char* MapInput(int fd, u64 fileSize, bool numa, bool hugePages) {
+            u64 mappedSize = InputMappedSize(fileSize);
+            char* input = (char*)mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (input == MAP_FAILED) return input;
+            // The file is mapped read-only, as populating a writable private mapping
+            // would copy every page
+            int flags = MAP_PRIVATE | MAP_FIXED | ((numa || hugePages) ? 0 : MAP_POPULATE);
+            if (mmap(input, fileSize, PROT_READ, flags, fd, 0) == MAP_FAILED) {
+                munmap(input, mappedSize);
+                return (const char*)MAP_FAILED;
+            }
+
+            u64 pageSize = sysconf(_SC_PAGESIZE);
+            char* lastPage = input + fileSize / pageSize * pageSize;
+            mprotect(lastPage, pageSize, PROT_READ | PROT_WRITE);
+            input[fileSize] = '\n';
+            mprotect(input, mappedSize, PROT_READ);
+
+            if (hugePages) {
+                madvise(input, fileSize, MADV_HUGEPAGE);
+                if (!numa) madvise(input, fileSize, MADV_POPULATE_READ);
+            }
+            return input;
+        }
+
+        inline void UnmapInput(const char* input, u64 fileSize) {
+            munmap((void*)input, InputMappedSize(fileSize));
+        }
+
+        // Slots of a table which are no longer used. Freeing a large array takes a while,
+        // so ParallelHashTable frees them after releasing the lock of the bucket.
+        struct RetiredSlots {
+            void* slots = nullptr;
+            u64 bytes = 0;
+            bool hugePages = false;
+
+            void Free() {
+                if (slots != nullptr) FreeSlots(slots, bytes, hugePages);
+            }
+        };
+
+        template <typename Key = u64>
         class HashTable {
+            using Traits = KeyTraits<Key>;
             static constexpr float LOAD_FACTOR = 0.5;
             static constexpr u32 INIT_CAPACITY = 64;
-            u64 EMPTY = 0xffffffffffffffff;
-            u32 capacity;
-            u32 size;
-            u64 *data;
+            u64 capacity;
+            u64 size;
+            Key *data;
+            // False while data points into a mapping, which is never freed
+            bool owned = true;
+            // Node the slots are allocated on when the table grows (-1: any)
+            int node = -1;
+            bool hugePages = false;
+            typename Traits::Storage storage;
 
-            inline u32 CalcSlotIdx(u64 hash) {
-                return (hash >> 32) % capacity;
+            // An incremental table grows a little on every insert instead of all at once.
+            // Past GROW_START, the next array is allocated and GROW_INIT_STEP of its slots
+            // are emptied per insert. Once they all are, it becomes data, and GROW_MIGRATE_STEP
+            // slots of the previous array are moved into it per insert. Until then, keys
+            // are looked up in both arrays. The steps are large enough for both phases to
+            // end before the load factor of the array being filled reaches LOAD_FACTOR.
+            static constexpr float GROW_START = 0.375;
+            static constexpr u64 GROW_INIT_STEP = 1024;
+            static constexpr u64 GROW_MIGRATE_STEP = 256;
+            bool incremental = false;
+            Key* next = nullptr;
+            u64 nextCapacity = 0;
+            u64 initCursor = 0;
+            Key* old = nullptr;
+            u64 oldCapacity = 0;
+            u64 migrateCursor = 0;
+            bool oldOwned = true;
+            RetiredSlots retired;
+
+            static inline u64 CalcSlotIdx(const Key &key, u64 slotsCapacity) {
+                return (Traits::Hash(key) >> 32) % slotsCapacity;
             }
 
-            inline bool InsertImpl(u64 hash) {
-                u32 i = CalcSlotIdx(hash);
-                for (; ; i = (i + 1) % capacity) {
-                    if (data[i] == EMPTY) { 
-                        data[i] = hash;
-                        return true;
-                    } else if (data[i] == hash) {
-                        return false;
+            // Returns the slot of slots holding key, or the empty slot where it should go.
+            // A table grown here always has empty slots, but one adopted from a corrupt
+            // seen-set file may not, so the probes stop after a full turn.
+            static inline Key* FindSlotIn(Key* slots, u64 slotsCapacity, const Key &key) {
+                u64 i = CalcSlotIdx(key, slotsCapacity);
+                for (u64 probes = 0; probes < slotsCapacity; probes++, i = (i + 1) % slotsCapacity) {
+                    if (Traits::IsEmpty(slots[i]) || Traits::Equal(slots[i], key)) {
+                        return slots + i;
                     }
                 }
+                fprintf(stderr, "corrupt hash table: no empty slot\n");
+                exit(1);
             }
 
-            void resize() {
-                u64* oldData = data;
-                data = (u64*) malloc(2 * capacity * sizeof(u64));
-                for (u32 i = 0; i < 2 * capacity; i++) {
-                    data[i] = EMPTY;
+            inline Key* FindSlot(const Key &key) {
+                return FindSlotIn(data, capacity, key);
+            }
+
+            inline bool InsertImpl(const Key &key) {
+                Key* slot = FindSlot(key);
+                if (!Traits::IsEmpty(*slot)) return false;
+                *slot = key;
+                return true;
+            }
+
+            void Rehash(u64 newCapacity) {
+                Key* oldData = data;
+                u64 oldCapacity = capacity;
+                data = (Key*)AllocSlots(newCapacity * sizeof(Key), hugePages);
+                if (node >= 0) BindToNode(data, newCapacity * sizeof(Key), node);
+                for (u64 i = 0; i < newCapacity; i++) {
+                    data[i] = Traits::EMPTY;
                 }
-                capacity *= 2;
+                capacity = newCapacity;
 
-                for (u32 i = 0; i < capacity / 2; i++) {
-                    if (oldData[i] != EMPTY) {
+                for (u64 i = 0; i < oldCapacity; i++) {
+                    if (!Traits::IsEmpty(oldData[i])) {
                         InsertImpl(oldData[i]);
                     }
                 }
 
-                free(oldData);
+                if (owned) FreeSlots(oldData, oldCapacity * sizeof(Key), hugePages);
+                owned = true;
+            }
+
+            void resize() {
+                Rehash(2 * capacity);
+            }
+
+            void GrowStep() {
+                if (next != nullptr) {
+                    u64 end = std::min(initCursor + GROW_INIT_STEP, nextCapacity);
+                    for (; initCursor < end; initCursor++) {
+                        next[initCursor] = Traits::EMPTY;
+                    }
+                    if (initCursor == nextCapacity) {
+                        old = data;
+                        oldCapacity = capacity;
+                        oldOwned = owned;
+                        migrateCursor = 0;
+                        data = next;
+                        capacity = nextCapacity;
+                        owned = true;
+                        next = nullptr;
+                    }
+                } else if (old != nullptr) {
+                    u64 end = std::min(migrateCursor + GROW_MIGRATE_STEP, oldCapacity);
+                    for (; migrateCursor < end; migrateCursor++) {
+                        if (!Traits::IsEmpty(old[migrateCursor])) {
+                            InsertImpl(old[migrateCursor]);
+                        }
+                    }
+                    if (migrateCursor == oldCapacity) {
+                        retired.Free();
+                        retired = {};
+                        if (oldOwned) retired = {old, oldCapacity * sizeof(Key), hugePages};
+                        old = nullptr;
+                    }
+                } else if (size > capacity * GROW_START) {
+                    nextCapacity = 2 * capacity;
+                    next = (Key*)AllocSlots(nextCapacity * sizeof(Key), hugePages);
+                    if (node >= 0) BindToNode(next, nextCapacity * sizeof(Key), node);
+                    initCursor = 0;
+                }
             }
         public:
+            using KeyType = Key;
+
             HashTable() {
-                data = (u64*)malloc(INIT_CAPACITY * sizeof(u64));
+                data = (Key*)malloc(INIT_CAPACITY * sizeof(Key));
                 capacity = INIT_CAPACITY;
                 size = 0;
                 for (u64 i = 0; i < capacity; i++)
-                    data[i] = EMPTY;
+                    data[i] = Traits::EMPTY;
             }
 
             ~HashTable() {
-                free(data); 
+                if (owned) FreeSlots(data, capacity * sizeof(Key), hugePages);
+                if (next != nullptr) FreeSlots(next, nextCapacity * sizeof(Key), hugePages);
+                if (old != nullptr && oldOwned) FreeSlots(old, oldCapacity * sizeof(Key), hugePages);
+                retired.Free();
             }
 
-            bool Find(u64 hash) {
-                u32 i = CalcSlotIdx(hash);
-                for (; ; i = (i + 1) % capacity) {
-                    if (data[i] == EMPTY) { 
-                        return false;
-                    } else if (data[i] == hash) {
-                        return true;
+            RetiredSlots TakeRetired() {
+                RetiredSlots taken = retired;
+                retired = {};
+                return taken;
+            }
+
+            // Makes the table grow incrementally, so that no insert has to rehash the whole
+            // table. This bounds the time a bucket of ParallelHashTable is locked for.
+            void SetIncremental(bool incrementalGrowth) {
+                FinishGrowth();
+                incremental = incrementalGrowth;
+            }
+
+            // Completes the growth in progress, after which all keys are in Slots()
+            void FinishGrowth() {
+                while (next != nullptr || old != nullptr) {
+                    GrowStep();
+                }
+            }
+
+            // Uses the slots of a table saved before, e.g. mapped from a seen-set file,
+            // without rehashing them. The slots are written in place until the table grows
+            // and must stay valid as long as the table.
+            void Adopt(Key* slots, u64 slotsCapacity, u64 slotsSize) {
+                if (owned) FreeSlots(data, capacity * sizeof(Key), hugePages);
+                data = slots;
+                capacity = slotsCapacity;
+                size = slotsSize;
+                owned = false;
+            }
+
+            const Key* Slots() const {
+                return data;
+            }
+
+            void SetNode(int slotsNode) {
+                node = slotsNode;
+            }
+
+            // Has to be set while the slots are smaller than a huge page, e.g. right after
+            // construction, since they are freed the way they were allocated
+            void SetHugePages(bool slotsHugePages) {
+                assert(capacity * sizeof(Key) < HUGE_PAGE_SIZE);
+                hugePages = slotsHugePages;
+            }
+
+            u64 Capacity() const {
+                return capacity;
+            }
+
+            // Grows the table once so that keyNum keys fit without growing again
+            void Reserve(u64 keyNum) {
+                FinishGrowth();
+                u64 needed = keyNum / LOAD_FACTOR + 1;
+                if (needed > capacity) Rehash(needed);
+            }
+
+            bool Find(const Key &key) {
+                if (!Traits::IsEmpty(*FindSlot(key))) return true;
+                return old != nullptr && !Traits::IsEmpty(*FindSlotIn(old, oldCapacity, key));
+            }
+
+            bool Insert(const Key &key) {
+                if (incremental) {
+                    GrowStep();
+                    // Only reached if the steps could not keep up, e.g. after Adopt
+                    if (size > capacity * LOAD_FACTOR) {
+                        FinishGrowth();
                     }
                 }
+                while (size > capacity * LOAD_FACTOR) {
+                    resize();
+                }
+
+                Key* slot = FindSlot(key);
+                if (!Traits::IsEmpty(*slot)) return false;
+                if (old != nullptr && !Traits::IsEmpty(*FindSlotIn(old, oldCapacity, key))) return false;
+                *slot = Traits::Store(key, storage);
+                size++;
+                return true;
             }
 
-            bool Insert(u64 hash) {
+            // Returns the slot holding key, storing key first if it is not in the table.
+            // The reference is valid until the next insertion. Not for incremental tables.
+            Key& FindOrInsert(const Key &key, bool &inserted) {
+                assert(!incremental);
                 while (size > capacity * LOAD_FACTOR) {
                     resize();
                 }
 
-                bool insertResult = InsertImpl(hash);
-                size += insertResult;
-                return insertResult;
+                Key* slot = FindSlot(key);
+                inserted = Traits::IsEmpty(*slot);
+                if (inserted) {
+                    *slot = Traits::Store(key, storage);
+                    size++;
+                }
+                return *slot;
+            }
+
+            u64 Size() {
+                return size;
+            }
+
+            inline void Prefetch(const Key &key) {
+                PrefetchData(key);
+                if (old != nullptr) {
+                    __builtin_prefetch(old + CalcSlotIdx(key, oldCapacity));
+                }
+            }
+
+            // Same as Prefetch without the array being migrated, whose fields GrowStep
+            // changes without ordering them. For callers not holding the table's lock.
+            inline void PrefetchData(const Key &key) {
+                __builtin_prefetch(data + CalcSlotIdx(key, capacity));
+            }
+        };
+
+        template <typename Key = u64>
+        class ParallelHashTable {
+            using Traits = KeyTraits<Key>;
+            struct Bucket {
+                std::shared_mutex mtx;
+                HashTable<Key> table;
+
+                Bucket() : table() {} 
+
+                Bucket(Bucket&& other) noexcept : table(std::move(other.table)) {}
+            };
+            std::vector<Bucket> buckets;
+
+            static constexpr u32 BUCKETS_THREADS_FACTOR = 64;
+
+            inline u32 CalcBucketIdx(const Key &key) {
+                return (Traits::Hash(key) & ((1LL << 32) - 1)) % buckets.size();
+            }
+        public:
+            using KeyType = Key;
+
+            ParallelHashTable(u32 num_threads) : ParallelHashTable(num_threads, 0) {}
+
+            // The number of buckets is part of a saved table, since it decides the bucket
+            // of every key. 0 picks the number for num_threads.
+            ParallelHashTable(u32 num_threads, u32 bucketNum) {
+                buckets.resize(bucketNum > 0 ? bucketNum : num_threads * BUCKETS_THREADS_FACTOR);
+                SetIncremental(true);
+            }
+
+            // The buckets grow incrementally unless this is turned off
+            void SetIncremental(bool incremental) {
+                for (auto &bucket: buckets) {
+                    bucket.table.SetIncremental(incremental);
+                }
+            }
+
+            u32 BucketIdx(const Key &key) {
+                return CalcBucketIdx(key);
+            }
+
+            u32 BucketNum() const {
+                return buckets.size();
+            }
+
+            HashTable<Key>& BucketTable(u32 bucketIdx) {
+                return buckets[bucketIdx].table;
+            }
+
+            // Gives the buckets to the NUMA nodes in blocks of consecutive indices. The
+            // bucket of a key depends on its hash only, so this maps hashes to nodes.
+            void PlaceBuckets() {
+                const std::vector<NumaNode> &nodes = NumaNodes();
+                for (u64 i = 0; i < buckets.size(); i++) {
+                    buckets[i].table.SetNode(nodes[i * nodes.size() / buckets.size()].id);
+                }
+            }
+
+            void UseHugePages() {
+                for (auto &bucket: buckets) {
+                    bucket.table.SetHugePages(true);
+                }
+            }
+
+            // Sizes every bucket for its share of keyNum keys
+            void Reserve(u64 keyNum) {
+                for (auto &bucket: buckets) {
+                    bucket.table.Reserve(keyNum / buckets.size());
+                }
+            }
+
+            bool Insert(const Key &key) {
+                u32 bucketIdx = CalcBucketIdx(key);
+                Bucket &bucket = buckets[bucketIdx];
+
+                std::shared_lock<std::shared_mutex> readLock(bucket.mtx);
+                if (bucket.table.Find(key)) {
+                    return false;
+                }
+                readLock.unlock();
+                std::unique_lock<std::shared_mutex> writeLock(bucket.mtx);
+                bool inserted = bucket.table.Insert(key);
+                auto retired = bucket.table.TakeRetired();
+                writeLock.unlock();
+                retired.Free();
+                return inserted;
+            }
+
+            void ShowBucketsSize() {
+                for (auto &bucket: buckets) {
+                    std::cerr << bucket.table.Size() << "\n";
+                }
+            }
+
+            inline void Prefetch(const Key &key) {
+                u32 bucketIdx = CalcBucketIdx(key);
+                Bucket &bucket = buckets[bucketIdx];
+                // Called without the bucket lock
+                bucket.table.PrefetchData(key);
+            }
+
+            u64 Size() {
+                u64 ret = 0;
+                for (auto &bucket: buckets) {
+                    ret += bucket.table.Size();
+                }
+                return ret;
             }
+        };
+
+        // Open-addressing table shared by all threads. Slots are claimed with a CAS on EMPTY
+        // and the table grows by cooperative migration: every thread that notices a migration
+        // copies a range of slots into the next array before going on with its own inserts.
+        class LockFreeHashTable {
+            static constexpr float LOAD_FACTOR = 0.5;
+            static constexpr u64 INIT_CAPACITY = 1 << 16;
+            static constexpr u64 MIGRATE_STRIDE = 4096;
+            static constexpr u32 COUNTER_FLUSH = 256;
+            static constexpr u32 MAX_PROBE = 256;
+            // Slots are zero initialized so that arrays can be obtained with calloc.
+            // FROZEN marks an empty slot which has been visited by the migration.
+            static constexpr u64 EMPTY = 0;
+            static constexpr u64 FROZEN = 1;
+
+            struct Array {
+                u64 capacity;
+                u32 shift;
+                std::atomic<u64>* slots;
+                std::atomic<Array*> next;
+                std::atomic<u64> claimCursor;
+                std::atomic<u64> copied;
+                bool hugePages;
+
+                Array(u64 cap, bool hugePages) : capacity(cap), next(nullptr), claimCursor(0), copied(0), hugePages(hugePages) {
+                    shift = 64 - __builtin_ctzll(cap);
+                    slots = (std::atomic<u64>*)AllocSlots(cap * sizeof(std::atomic<u64>), hugePages, true);
+                }
+
+                ~Array() {
+                    FreeSlots(slots, capacity * sizeof(std::atomic<u64>), hugePages);
+                }
+
+                inline u64 CalcSlotIdx(u64 hash) {
+                    return hash >> shift;
+                }
+            };
+
+            struct alignas(64) ThreadCounter {
+                u64 inserted = 0;
+                u32 pending = 0;
+            };
+
+            // Placeholder published in Array::next while the next array is being allocated
+            Array* const ALLOCATING = (Array*)alignof(Array);
+
+            std::atomic<Array*> current;
+            std::atomic<u64> approxSize;
+            std::vector<ThreadCounter> counters;
+            std::vector<Array*> retired;
+            std::mutex retiredMutex;
+            bool hugePages;
+
+            static inline u64 Remap(u64 hash) {
+                return hash <= FROZEN ? hash + 2 : hash;
+            }
+
+            // Insert without reporting. Used when copying slots into the next array,
+            // which is never migrated before the copy is complete.
+            static void CopyInto(Array* arr, u64 hash) {
+                u64 mask = arr->capacity - 1;
+                for (u64 i = arr->CalcSlotIdx(hash); ; i = (i + 1) & mask) {
+                    u64 v = arr->slots[i].load(std::memory_order_acquire);
+                    if (v == EMPTY) {
+                        if (arr->slots[i].compare_exchange_strong(v, hash)) return;
+                    }
+                    if (v == hash) return;
+                }
+            }
+
+            void MigrateSlot(Array* old, Array* next, u64 i) {
+                u64 v = EMPTY;
+                if (old->slots[i].compare_exchange_strong(v, FROZEN)) return;
+                CopyInto(next, v);
+            }
+
+            void StartMigration(Array* arr) {
+                Array* expected = nullptr;
+                if (!arr->next.compare_exchange_strong(expected, ALLOCATING)) return;
+                arr->next.store(new Array(arr->capacity * 2, hugePages));
+            }
+
+            // Copy slots until every range of the old array has been claimed, then wait
+            // for the other helpers and publish the next array.
+            void HelpMigrate(Array* old) {
+                Array* next;
+                while ((next = old->next.load()) == ALLOCATING) _mm_pause();
+
+                while (true) {
+                    u64 beg = old->claimCursor.fetch_add(MIGRATE_STRIDE);
+                    if (beg >= old->capacity) break;
+                    u64 end = std::min(beg + MIGRATE_STRIDE, old->capacity);
+                    for (u64 i = beg; i < end; i++) {
+                        MigrateSlot(old, next, i);
+                    }
+                    old->copied.fetch_add(end - beg);
+                }
+
+                while (old->copied.load() < old->capacity) _mm_pause();
+
+                Array* expected = old;
+                if (current.compare_exchange_strong(expected, next)) {
+                    // Other threads may still be probing the old array, so it is kept alive
+                    // until the table is destroyed.
+                    std::unique_lock<std::mutex> lock(retiredMutex);
+                    retired.push_back(old);
+                }
+            }
+
+            void CountInsert(Array* arr) {
+                ThreadCounter &counter = counters[omp_get_thread_num() % counters.size()];
+                counter.inserted++;
+                if (++counter.pending == COUNTER_FLUSH) {
+                    u64 size = approxSize.fetch_add(counter.pending) + counter.pending;
+                    counter.pending = 0;
+                    if (size > arr->capacity * LOAD_FACTOR) {
+                        StartMigration(arr);
+                    }
+                }
+            }
+        public:
+            using KeyType = u64;
+
+            LockFreeHashTable(u32 num_threads, bool hugePages = false) : approxSize(0), counters(num_threads), hugePages(hugePages) {
+                current.store(new Array(INIT_CAPACITY, hugePages));
+            }
+
+            // Replaces the empty initial array by one where keyNum keys fit. Has to be
+            // called before the first insert.
+            void Reserve(u64 keyNum) {
+                u64 cap = INIT_CAPACITY;
+                while (keyNum > cap * LOAD_FACTOR) cap *= 2;
+                if (cap == current.load()->capacity) return;
+                delete current.load();
+                current.store(new Array(cap, hugePages));
+            }
+
+            ~LockFreeHashTable() {
+                delete current.load();
+                for (Array* arr: retired) {
+                    delete arr;
+                }
+            }
+
+            bool Insert(u64 hash) {
+                hash = Remap(hash);
+                Array* arr = current.load(std::memory_order_acquire);
+                while (true) {
+                    if (arr->next.load(std::memory_order_relaxed) != nullptr) {
+                        HelpMigrate(arr);
+                        arr = current.load(std::memory_order_acquire);
+                        continue;
+                    }
+
+                    u64 mask = arr->capacity - 1;
+                    u64 i = arr->CalcSlotIdx(hash);
+                    bool retry = false;
+                    for (u32 probe = 0; ; i = (i + 1) & mask, probe++) {
+                        u64 v = arr->slots[i].load(std::memory_order_acquire);
+                        if (v == EMPTY) {
+                            if (arr->slots[i].compare_exchange_strong(v, hash)) {
+                                CountInsert(arr);
+                                return true;
+                            }
+                        }
+                        if (v == hash) {
+                            return false;
+                        } else if (v == FROZEN || probe == MAX_PROBE) {
+                            // Either the migration already passed this slot or the array
+                            // is crowded because size counters lag behind
+                            StartMigration(arr);
+                            retry = true;
+                            break;
+                        }
+                    }
+                    if (retry) {
+                        HelpMigrate(arr);
+                        arr = current.load(std::memory_order_acquire);
+                    }
+                }
+            }
+
+            inline void Prefetch(u64 hash) {
+                Array* arr = current.load(std::memory_order_relaxed);
+                __builtin_prefetch(arr->slots + arr->CalcSlotIdx(Remap(hash)));
+            }
+
+            u64 Size() {
+                u64 ret = 0;
+                for (auto &counter: counters) {
+                    ret += counter.inserted;
+                }
+                return ret;
+            }
+        };
+
+        constexpr u64 KEY_LO = 464828032585196773;
+        constexpr u64 KEY_HI = 884041218509897051;
+        const u8x16 key = _mm_set_epi64x(KEY_HI, KEY_LO);
+        const u8x16 chunkMask[17] = {
+            _mm_set_epi8(0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00),
+            _mm_set_epi8(0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff),
+            _mm_set_epi8(0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0xff),
+            _mm_set_epi8(0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff),
+            _mm_set_epi8(0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff),
+            _mm_set_epi8(0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff, 0xff),
+            _mm_set_epi8(0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff),
+            _mm_set_epi8(0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff),
+            _mm_set_epi8(0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff),
+            _mm_set_epi8(0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff),
+            _mm_set_epi8(0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff),
+            _mm_set_epi8(0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff),
+            _mm_set_epi8(0x00, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff),
+            _mm_set_epi8(0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff),
+            _mm_set_epi8(0x00, 0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff),
+            _mm_set_epi8(0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff),
+            _mm_set_epi8(0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff)
+        };
+        
+
+        // Like Hash, this may load up to 15 bytes past the end of the lines.
+        // Only SSE2 is used, so that it runs on any x86-64 CPU.
+        inline bool LinesEqual(const char* a, const char* b, u32 len) {
+            for (; len > 16; len -= 16, a += 16, b += 16) {
+                u8x16 eq = _mm_cmpeq_epi8(_mm_loadu_si128((u8x16*)a), _mm_loadu_si128((u8x16*)b));
+                if (_mm_movemask_epi8(eq) != 0xffff) return false;
+            }
+            u8x16 eq = _mm_cmpeq_epi8(_mm_loadu_si128((u8x16*)a), _mm_loadu_si128((u8x16*)b));
+            u32 lenMask = (1u << len) - 1;
+            return (_mm_movemask_epi8(eq) & lenMask) == lenMask;
+        }
+
+        constexpr u32 KEY_MAX_FIELDS = 16;
+
+        // Part of the key of a line
+        struct KeySpan {
+            const char* beg;
+            const char* end;
+        };
+
+        // Paths nested deeper are rejected, so that the containers of the matched keys
+        // fit in the bits of JsonScan::arrays
+        constexpr u32 JSON_MAX_PATH_DEPTH = 32;
+
+        // The key fields or JSON key paths of Options. Each field or value is hashed on its
+        // own, so that a field missing from a line is the same as an empty one.
+        struct KeySpec {
+            char separator = '\t';
+            std::vector<u32> fields;    // Ascending, from 0
+            std::vector<std::vector<std::string>> jsonPaths;    // Keys of each path, outermost first
+
+            KeySpec() = default;
+
+            explicit KeySpec(const Options &options) : separator(options.fieldSeparator) {
+                for (u32 field: options.keyFields) {
+                    if (field == 0) {
+                        fprintf(stderr, "keyFields: fields are numbered from 1\n");
+                        exit(1);
+                    }
+                    fields.push_back(field - 1);
+                }
+                std::sort(fields.begin(), fields.end());
+                fields.erase(std::unique(fields.begin(), fields.end()), fields.end());
+                if (fields.size() > KEY_MAX_FIELDS) {
+                    fprintf(stderr, "keyFields: at most %u fields\n", KEY_MAX_FIELDS);
+                    exit(1);
+                }
+
+                for (auto &path: options.jsonKeys) {
+                    jsonPaths.emplace_back();
+                    for (u64 beg = 0; beg <= path.size(); ) {
+                        u64 dot = std::min(path.find('.', beg), path.size());
+                        jsonPaths.back().push_back(path.substr(beg, dot - beg));
+                        if (jsonPaths.back().back().empty() || jsonPaths.back().size() > JSON_MAX_PATH_DEPTH) {
+                            fprintf(stderr, "jsonKeys: invalid key path \"%s\"\n", path.data());
+                            exit(1);
+                        }
+                        beg = dot + 1;
+                    }
+                }
+                if (jsonPaths.size() > KEY_MAX_FIELDS || (!jsonPaths.empty() && !fields.empty())) {
+                    fprintf(stderr, "jsonKeys: at most %u key paths, and no keyFields\n", KEY_MAX_FIELDS);
+                    exit(1);
+                }
+            }
+
+            bool Keyed() const {
+                return !fields.empty() || !jsonPaths.empty();
+            }
+
+            u32 SpanNum() const {
+                return jsonPaths.empty() ? fields.size() : jsonPaths.size();
+            }
+        };
+
+        // Hash kernels. Every kernel computes the same hashes, so that results do not
+        // depend on the CPU. The best one is selected once at startup (see ActiveKernel).
+        //
+        // 64-bit hash : XOR of AESENC(AESENC(block, key), key) over the zero-padded 16-byte
+        //               blocks of the line, folded to 64 bits.
+        // 128-bit hash : the same, except that block i is XORed with key + i before being
+        //                encrypted, the state starts from the length, and a final AESENC
+        //                is applied to the state.
+        namespace Kernel {
+            // HashLines finds the newlines of INDEX_BATCH lines in one pass (IndexLines)
+            // before hashing them, so that the hash loop does not wait for the newline scan
+            // of each line. Once a batch averages more than LONG_LINE bytes per line, the
+            // second pass over the lines costs more than it saves, and the remaining lines
+            // are scanned and hashed one at a time.
+            constexpr u32 INDEX_BATCH = 32;
+            constexpr u32 LONG_LINE = 128;
+
+            // Lines of at least LONG_HASH bytes are hashed in independent lanes (HashLanes).
+            // The lanes are XORed together, so the hash does not depend on the path taken.
+            constexpr u32 LONG_HASH = 64;
+
+            // State of the scan of a line for its key fields. The separators and the newline
+            // are visited in order, and the spans of the key fields are recorded as they go by.
+            struct FieldScan {
+                const KeySpec &key;
+                KeySpan* spans;
+                const char* fieldBeg;
+                u32 field = 0;      // Field starting at fieldBeg
+                u32 found = 0;      // Key fields found so far
+                const char* lineEnd = nullptr;
+
+                FieldScan(const KeySpec &key, KeySpan* spans, const char* lineBeg)
+                    : key(key), spans(spans), fieldBeg(lineBeg) {}
+
+                bool Done() const {
+                    return found == key.fields.size();
+                }
+
+                inline void EndField(const char* fieldEnd) {
+                    if (found < key.fields.size() && field == key.fields[found]) {
+                        spans[found++] = {fieldBeg, fieldEnd};
+                    }
+                    field++;
+                    fieldBeg = fieldEnd + 1;
+                }
+
+                // The key fields past the last field of the line are empty
+                inline void EndLine(const char* newline) {
+                    EndField(newline);
+                    for (; found < key.fields.size(); found++) {
+                        spans[found] = {newline, newline};
+                    }
+                    lineEnd = newline;
+                }
+            };
+
+            // Visits the separators and newlines of sepMask and newlineMask, where bit i
+            // stands for blockBeg[i]. Returns false once the line has ended. Once every key
+            // field is found, only the newline is looked for.
+            template <typename Mask>
+            inline bool EmitFields(Mask sepMask, Mask newlineMask, const char* blockBeg, const char* end, FieldScan &scan) {
+                Mask mask = scan.Done() ? newlineMask : (sepMask | newlineMask);
+                for (; mask != 0; mask &= mask - 1) {
+                    u32 bit = __builtin_ctzll(mask);
+                    const char* pos = blockBeg + bit;
+                    if (pos >= end) {
+                        scan.EndLine(end);
+                        return false;
+                    }
+                    if ((newlineMask >> bit) & 1) {
+                        scan.EndLine(pos);
+                        return false;
+                    }
+                    scan.EndField(pos);
+                    if (scan.Done()) mask &= newlineMask | ((Mask)1 << bit);
+                }
+                return true;
+            }
+
+            inline bool IsJsonSpace(char c) {
+                return c == ' ' || c == '\t' || c == '\r';
+            }
+
+            // State of the scan of a JSON line for the values of the key paths. Only the
+            // quotes, backslashes, colons, commas and brackets are visited, in order, which
+            // is enough to tell keys from values and to follow the nesting without building
+            // a DOM. A raw newline cannot appear in a JSON string, so it always ends the line.
+            struct JsonScan {
+                const KeySpec &key;
+                KeySpan* spans;
+                const char* end;
+                u32 depth = 0;
+                u64 arrays = 0;                 // Bit d is set when the container at depth d + 1 is an array
+                bool inString = false;
+                bool expectKey = false;
+                const char* escaped = nullptr;  // Byte following a backslash in a string
+                const char* keyBeg = nullptr;   // Set while a key is read and until its colon
+                const char* keyEnd = nullptr;
+                u32 matched[KEY_MAX_FIELDS];    // Keys of each path matched by the enclosing objects
+                u32 valueDepth[KEY_MAX_FIELDS]; // Depth of the value being captured, 0 if none
+                u32 found = 0;                  // Values captured and ended
+                const char* lineEnd = nullptr;
+
+                JsonScan(const KeySpec &key, KeySpan* spans, const char* end)
+                    : key(key), spans(spans), end(end) {
+                    for (u32 p = 0; p < key.jsonPaths.size(); p++) {
+                        spans[p] = {nullptr, nullptr};
+                        matched[p] = 0;
+                        valueDepth[p] = 0;
+                    }
+                }
+
+                bool Done() const {
+                    return found == key.jsonPaths.size();
+                }
+
+                bool InArray() const {
+                    return depth > 0 && depth <= 64 && ((arrays >> (depth - 1)) & 1);
+                }
+
+                // The key ending at keyEnd is followed by the colon at pos
+                inline void Key(const char* pos) {
+                    u32 keyLen = keyEnd - keyBeg;
+                    for (u32 p = 0; p < key.jsonPaths.size(); p++) {
+                        if (spans[p].beg != nullptr) continue;
+                        auto &path = key.jsonPaths[p];
+                        // A sibling of a matched key takes its place
+                        matched[p] = std::min(matched[p], depth - 1);
+                        if (matched[p] != depth - 1 || depth > path.size()) continue;
+                        auto &name = path[depth - 1];
+                        if (name.size() != keyLen || memcmp(name.data(), keyBeg, keyLen) != 0) continue;
+                        matched[p] = depth;
+                        if (depth == path.size()) {
+                            const char* valueBeg = pos + 1;
+                            while (valueBeg < end && IsJsonSpace(*valueBeg)) valueBeg++;
+                            spans[p].beg = valueBeg;
+                            valueDepth[p] = depth;
+                        }
+                    }
+                    keyBeg = nullptr;
+                }
+
+                // The values of the current depth end at the comma or bracket at pos
+                inline void EndValues(const char* pos) {
+                    for (u32 p = 0; p < key.jsonPaths.size(); p++) {
+                        if (valueDepth[p] != depth) continue;
+                        const char* valueEnd = pos;
+                        while (valueEnd > spans[p].beg && IsJsonSpace(valueEnd[-1])) valueEnd--;
+                        spans[p].end = valueEnd;
+                        valueDepth[p] = 0;
+                        found++;
+                    }
+                }
+
+                inline void Visit(const char* pos) {
+                    char c = *pos;
+                    if (pos == escaped) return;
+                    if (inString) {
+                        if (c == '\\') {
+                            escaped = pos + 1;
+                        } else if (c == '"') {
+                            inString = false;
+                            if (keyBeg != nullptr) keyEnd = pos;
+                        }
+                        return;
+                    }
+                    switch (c) {
+                    case '"':
+                        inString = true;
+                        if (expectKey) {
+                            keyBeg = pos + 1;
+                            expectKey = false;
+                        }
+                        break;
+                    case ':':
+                        if (keyBeg != nullptr) Key(pos);
+                        break;
+                    case ',':
+                        EndValues(pos);
+                        expectKey = depth > 0 && !InArray();
+                        break;
+                    case '{':
+                    case '[':
+                        if (depth < 64) {
+                            arrays = (arrays & ~(1ULL << depth)) | ((u64)(c == '[') << depth);
+                        }
+                        depth++;
+                        expectKey = c == '{';
+                        break;
+                    case '}':
+                    case ']':
+                        if (depth == 0) break;
+                        EndValues(pos);
+                        depth--;
+                        for (u32 p = 0; p < key.jsonPaths.size(); p++) {
+                            matched[p] = std::min(matched[p], depth);
+                        }
+                        expectKey = false;
+                        break;
+                    }
+                }
+
+                // Values still open end at the end of the line, and missing ones are empty
+                inline void EndLine(const char* newline) {
+                    for (u32 p = 0; p < key.jsonPaths.size(); p++) {
+                        if (spans[p].beg == nullptr) {
+                            spans[p] = {newline, newline};
+                        } else if (valueDepth[p] != 0) {
+                            const char* valueEnd = newline;
+                            while (valueEnd > spans[p].beg && IsJsonSpace(valueEnd[-1])) valueEnd--;
+                            spans[p].end = valueEnd;
+                        }
+                    }
+                    lineEnd = newline;
+                }
+            };
+
+            // Visits the bytes of structMask and the newlines of newlineMask, where bit i
+            // stands for blockBeg[i]. Returns false once the line has ended. Once every value
+            // is found, only the newline is looked for.
+            template <typename Mask>
+            inline bool EmitJson(Mask structMask, Mask newlineMask, const char* blockBeg, const char* end, JsonScan &scan) {
+                Mask mask = scan.Done() ? newlineMask : (structMask | newlineMask);
+                for (; mask != 0; mask &= mask - 1) {
+                    u32 bit = __builtin_ctzll(mask);
+                    const char* pos = blockBeg + bit;
+                    if (pos >= end) {
+                        scan.EndLine(end);
+                        return false;
+                    }
+                    if ((newlineMask >> bit) & 1) {
+                        scan.EndLine(pos);
+                        return false;
+                    }
+                    scan.Visit(pos);
+                    if (scan.Done()) mask &= newlineMask | ((Mask)1 << bit);
+                }
+                return true;
+            }
+
+            // Folds the hash of the next field of a key into the hash of the key, so that
+            // the fields are told apart by their position
+            inline void CombineHash(u64 &hash, u64 fieldHash) {
+                hash = ((hash ^ (hash >> 29)) * 0xbf58476d1ce4e5b9ULL) ^ fieldHash;
+            }
+
+            inline void CombineHash(WideHash &hash, const WideHash &fieldHash) {
+                CombineHash(hash.lo, fieldHash.lo);
+                CombineHash(hash.hi, fieldHash.hi);
+            }
+
+            // Appends the length of the line ending at each newline of mask to lens.
+            // Bit i of mask stands for blockBeg[i]. Returns false once lens is full or a
+            // newline at or past end is reached.
+            template <typename Mask>
+            inline bool EmitLines(
+                Mask mask, const char* blockBeg, const char* end,
+                const char* &lineBeg, u32* lens, u32 &lineNum, u32 maxLines
+            ) {
+                for (; mask != 0; mask &= mask - 1) {
+                    const char* newline = blockBeg + __builtin_ctzll(mask);
+                    if (newline >= end) return false;
+                    lens[lineNum++] = newline - lineBeg;
+                    lineBeg = newline + 1;
+                    if (lineNum == maxLines) return false;
+                }
+                return true;
+            }
+
+            // A last line without a newline ends at end
+            inline u32 FinishLines(const char* lineBeg, const char* end, u32* lens, u32 lineNum, u32 maxLines) {
+                if (lineNum < maxLines && lineBeg < end) {
+                    lens[lineNum++] = end - lineBeg;
+                }
+                return lineNum;
+            }
+
+            // The kernels only differ in how a line is scanned and hashed, which Isa provides
+            // as static functions: FindLineLen, IndexLines, HashBlocks, LocateFields and
+            // LocateJson. The entry points of every kernel are built from them below.
+            template <typename Isa, typename HashValue>
+            inline void Hash(const char* input, HashValue &hash, u32 &len) {
+                len = Isa::FindLineLen(input);
+                Isa::HashBlocks(input, len, hash);
+            }
+
+            // Hashes the lines starting at input until maxLines lines are hashed or end
+            // is reached. Returns the number of lines hashed.
+            template <typename Isa, typename HashValue>
+            inline u32 HashLines(const char* input, const char* end, HashValue* hashes, u32* lens, u32 maxLines) {
+                u32 lineNum = 0;
+                while (lineNum < maxLines) {
+                    const char* batchBeg = input;
+                    u32 indexed = Isa::IndexLines(input, end, lens + lineNum, std::min(maxLines - lineNum, INDEX_BATCH));
+                    for (u32 i = lineNum; i < lineNum + indexed; i++) {
+                        Isa::HashBlocks(input, lens[i], hashes[i]);
+                        input += lens[i] + 1;
+                    }
+                    lineNum += indexed;
+                    if (indexed < INDEX_BATCH) return lineNum;
+                    if ((u64)(input - batchBeg) > (u64)INDEX_BATCH * LONG_LINE) break;
+                }
+                for (; lineNum < maxLines && input < end; lineNum++) {
+                    lens[lineNum] = std::min((u64)Isa::FindLineLen(input), (u64)(end - input));
+                    Isa::HashBlocks(input, lens[lineNum], hashes[lineNum]);
+                    input += lens[lineNum] + 1;
+                }
+                return lineNum;
+            }
+
+            template <typename Isa, typename HashValue>
+            inline u32 HashKeyLines(const char* input, const char* end, HashValue* hashes, u32* lens, u32 maxLines, const KeySpec &key) {
+                KeySpan spans[KEY_MAX_FIELDS];
+                u32 lineNum = 0;
+                for (; lineNum < maxLines && input < end; lineNum++) {
+                    lens[lineNum] = key.jsonPaths.empty()
+                        ? Isa::LocateFields(input, end, key, spans) : Isa::LocateJson(input, end, key, spans);
+                    Isa::HashBlocks(spans[0].beg, spans[0].end - spans[0].beg, hashes[lineNum]);
+                    for (u32 i = 1; i < key.SpanNum(); i++) {
+                        HashValue fieldHash;
+                        Isa::HashBlocks(spans[i].beg, spans[i].end - spans[i].beg, fieldHash);
+                        CombineHash(hashes[lineNum], fieldHash);
+                    }
+                    input += lens[lineNum] + 1;
+                }
+                return lineNum;
+            }
+
+            // Scans of the SIMD kernels. Blocks loads an aligned block of Blocks::SIZE bytes
+            // and compares it into masks of type Blocks::Mask, where bit i stands for byte i
+            // (NewlineMask, FieldMasks and JsonMasks). Aligned loads never cross a page
+            // boundary, so the scans may load bytes before input and past end.
+            template <typename Blocks>
+            struct BlockScan {
+                using Mask = typename Blocks::Mask;
+
+                static inline const char* Align(const char* input) {
+                    return (const char*)((uintptr_t)input & ~(uintptr_t)(Blocks::SIZE - 1));
+                }
+
+                static inline u32 FindLineLen(const char* input) {
+                    const char* aligned = Align(input);
+                    Mask mask = Blocks::NewlineMask(aligned) >> (input - aligned);
+                    if (mask != 0) return __builtin_ctzll(mask);
+                    while (true) {
+                        aligned += Blocks::SIZE;
+                        mask = Blocks::NewlineMask(aligned);
+                        if (mask != 0) return aligned + __builtin_ctzll(mask) - input;
+                    }
+                }
+
+                static inline u32 IndexLines(const char* input, const char* end, u32* lens, u32 maxLines) {
+                    const char* aligned = Align(input);
+                    const char* lineBeg = input;
+                    u32 lineNum = 0;
+                    Mask mask = Blocks::NewlineMask(aligned) & (~(Mask)0 << (input - aligned));
+                    while (EmitLines(mask, aligned, end, lineBeg, lens, lineNum, maxLines)) {
+                        aligned += Blocks::SIZE;
+                        if (aligned >= end) break;
+                        mask = Blocks::NewlineMask(aligned);
+                    }
+                    return FinishLines(lineBeg, end, lens, lineNum, maxLines);
+                }
+
+                // Returns the length of the line starting at input and stores the spans of
+                // the key fields in spans
+                static inline u32 LocateFields(const char* input, const char* end, const KeySpec &key, KeySpan* spans) {
+                    FieldScan scan(key, spans, input);
+                    const char* aligned = Align(input);
+                    Mask sepMask, newlineMask;
+                    Blocks::FieldMasks(aligned, key.separator, sepMask, newlineMask);
+                    Mask skip = ~(Mask)0 << (input - aligned);
+                    while (EmitFields(sepMask & skip, newlineMask & skip, aligned, end, scan)) {
+                        aligned += Blocks::SIZE;
+                        if (aligned >= end) {
+                            scan.EndLine(end);
+                            break;
+                        }
+                        Blocks::FieldMasks(aligned, key.separator, sepMask, newlineMask);
+                        skip = ~(Mask)0;
+                    }
+                    return scan.lineEnd - input;
+                }
+
+                // Returns the length of the JSON line starting at input and stores the spans
+                // of the values of the key paths in spans
+                static inline u32 LocateJson(const char* input, const char* end, const KeySpec &key, KeySpan* spans) {
+                    JsonScan scan(key, spans, end);
+                    const char* aligned = Align(input);
+                    Mask structMask, newlineMask;
+                    Blocks::JsonMasks(aligned, structMask, newlineMask);
+                    Mask skip = ~(Mask)0 << (input - aligned);
+                    while (EmitJson(structMask & skip, newlineMask & skip, aligned, end, scan)) {
+                        aligned += Blocks::SIZE;
+                        if (aligned >= end) {
+                            scan.EndLine(end);
+                            break;
+                        }
+                        Blocks::JsonMasks(aligned, structMask, newlineMask);
+                        skip = ~(Mask)0;
+                    }
+                    return scan.lineEnd - input;
+                }
+            };
+
+            // Portable fallback with a software AES round
+            namespace Scalar {
+                constexpr unsigned char SBOX[256] = {
+                    0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+                    0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+                    0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+                    0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+                    0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+                    0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+                    0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+                    0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+                    0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+                    0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+                    0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+                    0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+                    0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+                    0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+                    0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+                    0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16
+                };
+
+                inline unsigned char XTime(unsigned char x) {
+                    return (x << 1) ^ ((x >> 7) * 0x1b);
+                }
+
+                // Same as _mm_aesenc_si128 on two 64-bit words
+                inline void AesEnc(u64 &lo, u64 &hi, u64 keyLo, u64 keyHi) {
+                    unsigned char in[16], out[16];
+                    memcpy(in, &lo, 8);
+                    memcpy(in + 8, &hi, 8);
+                    // ShiftRows and SubBytes. Byte r + 4c holds row r of column c.
+                    for (u32 c = 0; c < 4; c++) {
+                        for (u32 r = 0; r < 4; r++) {
+                            out[r + 4 * c] = SBOX[in[r + 4 * ((c + r) % 4)]];
+                        }
+                    }
+                    // MixColumns
+                    for (u32 c = 0; c < 4; c++) {
+                        unsigned char* col = out + 4 * c;
+                        unsigned char a0 = col[0], a1 = col[1], a2 = col[2], a3 = col[3];
+                        unsigned char all = a0 ^ a1 ^ a2 ^ a3;
+                        col[0] ^= all ^ XTime(a0 ^ a1);
+                        col[1] ^= all ^ XTime(a1 ^ a2);
+                        col[2] ^= all ^ XTime(a2 ^ a3);
+                        col[3] ^= all ^ XTime(a3 ^ a0);
+                    }
+                    memcpy(&lo, out, 8);
+                    memcpy(&hi, out + 8, 8);
+                    lo ^= keyLo;
+                    hi ^= keyHi;
+                }
+
+                inline void LoadBlock(const char* input, u32 len, u64 &lo, u64 &hi) {
+                    char block[16] = {};
+                    memcpy(block, input, std::min(len, 16u));
+                    memcpy(&lo, block, 8);
+                    memcpy(&hi, block + 8, 8);
+                }
+
+                struct Isa {
+                    static inline u32 FindLineLen(const char* input) {
+                        return (const char*)rawmemchr(input, '\n') - input;
+                    }
+
+                    static inline u32 IndexLines(const char* input, const char* end, u32* lens, u32 maxLines) {
+                        u32 lineNum = 0;
+                        while (lineNum < maxLines && input < end) {
+                            const char* newline = (const char*)memchr(input, '\n', end - input);
+                            if (newline == NULL) newline = end;
+                            lens[lineNum++] = newline - input;
+                            input = newline + 1;
+                        }
+                        return lineNum;
+                    }
+
+                    static inline void HashBlocks(const char* input, u32 len, u64 &hash) {
+                        u64 state = 0;
+                        for (u32 tmpLen = len; tmpLen > 0; tmpLen -= std::min(tmpLen, 16u), input += 16) {
+                            u64 lo, hi;
+                            LoadBlock(input, tmpLen, lo, hi);
+                            AesEnc(lo, hi, KEY_LO, KEY_HI);
+                            AesEnc(lo, hi, KEY_LO, KEY_HI);
+                            state ^= lo ^ hi;
+                        }
+                        hash = state;
+                    }
+
+                    static inline void HashBlocks(const char* input, u32 len, WideHash &hash) {
+                        u64 stateLo = len, stateHi = len;
+                        u64 tweakLo = KEY_LO, tweakHi = KEY_HI;
+                        for (u32 tmpLen = len; tmpLen > 0; tmpLen -= std::min(tmpLen, 16u), input += 16) {
+                            u64 lo, hi;
+                            LoadBlock(input, tmpLen, lo, hi);
+                            lo ^= tweakLo;
+                            hi ^= tweakHi;
+                            AesEnc(lo, hi, KEY_LO, KEY_HI);
+                            AesEnc(lo, hi, KEY_LO, KEY_HI);
+                            stateLo ^= lo;
+                            stateHi ^= hi;
+                            tweakLo++;
+                            tweakHi++;
+                        }
+                        AesEnc(stateLo, stateHi, KEY_LO, KEY_HI);
+                        hash.lo = stateLo;
+                        hash.hi = stateHi;
+                    }
+
+                    static inline u32 LocateFields(const char* input, const char* end, const KeySpec &key, KeySpan* spans) {
+                        FieldScan scan(key, spans, input);
+                        const char* pos = input;
+                        for (; pos < end && *pos != '\n'; pos++) {
+                            if (*pos == key.separator && !scan.Done()) scan.EndField(pos);
+                        }
+                        scan.EndLine(pos);
+                        return pos - input;
+                    }
+
+                    static inline u32 LocateJson(const char* input, const char* end, const KeySpec &key, KeySpan* spans) {
+                        JsonScan scan(key, spans, end);
+                        const char* pos = input;
+                        for (; pos < end && *pos != '\n'; pos++) {
+                            if (!scan.Done() && memchr("\"\\:,{}[]", *pos, 8) != nullptr) scan.Visit(pos);
+                        }
+                        scan.EndLine(pos);
+                        return pos - input;
+                    }
+                };
+
+                inline u32 FindLineLen(const char* input) {
+                    return Isa::FindLineLen(input);
+                }
+
+                template <typename HashValue>
+                void Hash(const char* input, HashValue &hash, u32 &len) {
+                    Kernel::Hash<Isa>(input, hash, len);
+                }
+
+                template <typename HashValue>
+                u32 HashLines(const char* input, const char* end, HashValue* hashes, u32* lens, u32 maxLines) {
+                    return Kernel::HashLines<Isa>(input, end, hashes, lens, maxLines);
+                }
+
+                template <typename HashValue>
+                u32 HashKeyLines(const char* input, const char* end, HashValue* hashes, u32* lens, u32 maxLines, const KeySpec &key) {
+                    return Kernel::HashKeyLines<Isa>(input, end, hashes, lens, maxLines, key);
+                }
+            }
+            namespace SSE42 {
+                // Loads and compares of 16-byte blocks
+                struct Blocks {
+                    using Mask = u32;
+                    static constexpr u32 SIZE = 16;
+
+                    __attribute__((target("sse4.2,aes")))
+                    static inline Mask NewlineMask(const char* aligned) {
+                        return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((u8x16*)aligned), _mm_set1_epi8('\n')));
+                    }
+
+                    __attribute__((target("sse4.2,aes")))
+                    static inline void FieldMasks(const char* aligned, char separator, Mask &sepMask, Mask &newlineMask) {
+                        u8x16 block = _mm_load_si128((u8x16*)aligned);
+                        sepMask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8(separator)));
+                        newlineMask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8('\n')));
+                    }
+
+                    // Quotes, backslashes, colons, commas and brackets, and newlines
+                    __attribute__((target("sse4.2,aes")))
+                    static inline void JsonMasks(const char* aligned, Mask &structMask, Mask &newlineMask) {
+                        u8x16 block = _mm_load_si128((u8x16*)aligned);
+                        u8x16 structural = _mm_setzero_si128();
+                        for (char c: {'"', '\\', ':', ',', '{', '}', '[', ']'}) {
+                            structural = _mm_or_si128(structural, _mm_cmpeq_epi8(block, _mm_set1_epi8(c)));
+                        }
+                        structMask = _mm_movemask_epi8(structural);
+                        newlineMask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8('\n')));
+                    }
+                };
+
+                // Hashes 16-byte blocks with AES-NI. The AVX2 kernel hashes the same way, as
+                // AES-NI has no 256-bit form there.
+                struct AesBlocks {
+                    // Hashes the 64-byte groups of a long line in four lanes. The two rounds of a
+                    // block depend on each other, but the lanes do not, so four blocks are in
+                    // flight in the AES unit. Advances input, tmpLen and tweak past the hashed
+                    // blocks.
+                    template <bool Tweaked>
+                    __attribute__((target("sse4.2,aes")))
+                    static inline u8x16 HashLanes(const char* &input, u32 &tmpLen, u8x16 &tweak) {
+                        u8x16 lanes[4], tweaks[4];
+                        for (unsigned i = 0; i < 4; i++) {
+                            lanes[i] = _mm_setzero_si128();
+                            tweaks[i] = _mm_add_epi64(tweak, _mm_set_epi64x(i, i));
+                        }
+                        const u8x16 tweakStep = _mm_set_epi64x(4, 4);
+                        for (; tmpLen >= 64; tmpLen -= 64, input += 64) {
+                            for (unsigned i = 0; i < 4; i++) {
+                                u8x16 chunk = _mm_loadu_si128((u8x16*)input + i);
+                                if (Tweaked) {
+                                    chunk = _mm_xor_si128(chunk, tweaks[i]);
+                                    tweaks[i] = _mm_add_epi64(tweaks[i], tweakStep);
+                                }
+                                chunk = _mm_aesenc_si128(chunk, key);
+                                chunk = _mm_aesenc_si128(chunk, key);
+                                lanes[i] = _mm_xor_si128(lanes[i], chunk);
+                            }
+                        }
+                        tweak = tweaks[0];
+                        return _mm_xor_si128(_mm_xor_si128(lanes[0], lanes[1]), _mm_xor_si128(lanes[2], lanes[3]));
+                    }
+
+                    __attribute__((target("sse4.2,aes")))
+                    static inline void HashBlocks(const char* input, u32 len, u64 &hash) {
+                        u8x16 state = _mm_setzero_si128();
+                        u32 tmpLen = len;
+                        if (len >= LONG_HASH) {
+                            u8x16 tweak = key;
+                            state = HashLanes<false>(input, tmpLen, tweak);
+                        }
+                        for (; tmpLen > 0; tmpLen -= std::min(tmpLen, 16u), input += 16) {
+                            u8x16 chunk = _mm_and_si128(_mm_loadu_si128((u8x16*)input), chunkMask[std::min(tmpLen, 16u)]);
+                            chunk = _mm_aesenc_si128(chunk, key);
+                            chunk = _mm_aesenc_si128(chunk, key);
+                            state = _mm_xor_si128(state, chunk);
+                        }
+                        hash = _mm_extract_epi64(state, 0) ^ _mm_extract_epi64(state, 1);
+                    }
+
+                    // The blocks are independent of each other, which keeps the AES units busy
+                    __attribute__((target("sse4.2,aes")))
+                    static inline void HashBlocks(const char* input, u32 len, WideHash &hash) {
+                        u8x16 state = _mm_set_epi64x(len, len);
+                        u8x16 tweak = key;
+                        const u8x16 tweakStep = _mm_set_epi64x(1, 1);
+                        u32 tmpLen = len;
+                        if (len >= LONG_HASH) {
+                            state = _mm_xor_si128(state, HashLanes<true>(input, tmpLen, tweak));
+                        }
+                        for (; tmpLen > 0; tmpLen -= std::min(tmpLen, 16u), input += 16) {
+                            u8x16 chunk = _mm_and_si128(_mm_loadu_si128((u8x16*)input), chunkMask[std::min(tmpLen, 16u)]);
+                            chunk = _mm_aesenc_si128(_mm_xor_si128(chunk, tweak), key);
+                            chunk = _mm_aesenc_si128(chunk, key);
+                            state = _mm_xor_si128(state, chunk);
+                            tweak = _mm_add_epi64(tweak, tweakStep);
+                        }
+                        state = _mm_aesenc_si128(state, key);
+                        hash.lo = _mm_extract_epi64(state, 0);
+                        hash.hi = _mm_extract_epi64(state, 1);
+                    }
+                };
+
+                struct Isa : BlockScan<Blocks>, AesBlocks {};
+
+                // Entry points of the kernel. Everything they call is inlined into them, and so
+                // compiled for the instruction set of the kernel.
+                __attribute__((target("sse4.2,aes"), flatten))
+                u32 FindLineLen(const char* input) {
+                    return Isa::FindLineLen(input);
+                }
+
+                template <typename HashValue>
+                __attribute__((target("sse4.2,aes"), flatten))
+                void Hash(const char* input, HashValue &hash, u32 &len) {
+                    Kernel::Hash<Isa>(input, hash, len);
+                }
+
+                template <typename HashValue>
+                __attribute__((target("sse4.2,aes"), flatten))
+                u32 HashLines(const char* input, const char* end, HashValue* hashes, u32* lens, u32 maxLines) {
+                    return Kernel::HashLines<Isa>(input, end, hashes, lens, maxLines);
+                }
+
+                template <typename HashValue>
+                __attribute__((target("sse4.2,aes"), flatten))
+                u32 HashKeyLines(const char* input, const char* end, HashValue* hashes, u32* lens, u32 maxLines, const KeySpec &key) {
+                    return Kernel::HashKeyLines<Isa>(input, end, hashes, lens, maxLines, key);
+                }
+            }
+
+            namespace AVX2 {
+                // Loads and compares of 32-byte blocks
+                struct Blocks {
+                    using Mask = u32;
+                    static constexpr u32 SIZE = 32;
+
+                    __attribute__((target("avx2,aes")))
+                    static inline Mask NewlineMask(const char* aligned) {
+                        return _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_load_si256((u8x32*)aligned), _mm256_set1_epi8('\n')));
+                    }
+
+                    __attribute__((target("avx2,aes")))
+                    static inline void FieldMasks(const char* aligned, char separator, Mask &sepMask, Mask &newlineMask) {
+                        u8x32 block = _mm256_load_si256((u8x32*)aligned);
+                        sepMask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, _mm256_set1_epi8(separator)));
+                        newlineMask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, _mm256_set1_epi8('\n')));
+                    }
+
+                    // Quotes, backslashes, colons, commas and brackets, and newlines
+                    __attribute__((target("avx2,aes")))
+                    static inline void JsonMasks(const char* aligned, Mask &structMask, Mask &newlineMask) {
+                        u8x32 block = _mm256_load_si256((u8x32*)aligned);
+                        u8x32 structural = _mm256_setzero_si256();
+                        for (char c: {'"', '\\', ':', ',', '{', '}', '[', ']'}) {
+                            structural = _mm256_or_si256(structural, _mm256_cmpeq_epi8(block, _mm256_set1_epi8(c)));
+                        }
+                        structMask = _mm256_movemask_epi8(structural);
+                        newlineMask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, _mm256_set1_epi8('\n')));
+                    }
+                };
+
+                struct Isa : BlockScan<Blocks>, SSE42::AesBlocks {};
+
+                // Entry points of the kernel. Everything they call is inlined into them, and so
+                // compiled for the instruction set of the kernel.
+                __attribute__((target("avx2,aes"), flatten))
+                u32 FindLineLen(const char* input) {
+                    return Isa::FindLineLen(input);
+                }
+
+                template <typename HashValue>
+                __attribute__((target("avx2,aes"), flatten))
+                void Hash(const char* input, HashValue &hash, u32 &len) {
+                    Kernel::Hash<Isa>(input, hash, len);
+                }
+
+                template <typename HashValue>
+                __attribute__((target("avx2,aes"), flatten))
+                u32 HashLines(const char* input, const char* end, HashValue* hashes, u32* lens, u32 maxLines) {
+                    return Kernel::HashLines<Isa>(input, end, hashes, lens, maxLines);
+                }
+
+                template <typename HashValue>
+                __attribute__((target("avx2,aes"), flatten))
+                u32 HashKeyLines(const char* input, const char* end, HashValue* hashes, u32* lens, u32 maxLines, const KeySpec &key) {
+                    return Kernel::HashKeyLines<Isa>(input, end, hashes, lens, maxLines, key);
+                }
+            }
+
+            // Scans 64 bytes and encrypts four blocks per iteration. The blocks are loaded
+            // with masked loads, so nothing past the end of the line is read.
+            namespace AVX512 {
+                using u8x64 = __m512i;
+
+                // Loads and compares of 64-byte blocks
+                struct Blocks {
+                    using Mask = u64;
+                    static constexpr u32 SIZE = 64;
+
+                    __attribute__((target("avx512f,avx512bw,avx512vl,aes,vaes")))
+                    static inline Mask NewlineMask(const char* aligned) {
+                        return _mm512_cmpeq_epi8_mask(_mm512_load_si512(aligned), _mm512_set1_epi8('\n'));
+                    }
+
+                    __attribute__((target("avx512f,avx512bw,avx512vl,aes,vaes")))
+                    static inline void FieldMasks(const char* aligned, char separator, Mask &sepMask, Mask &newlineMask) {
+                        u8x64 block = _mm512_load_si512(aligned);
+                        sepMask = _mm512_cmpeq_epi8_mask(block, _mm512_set1_epi8(separator));
+                        newlineMask = _mm512_cmpeq_epi8_mask(block, _mm512_set1_epi8('\n'));
+                    }
+
+                    // Quotes, backslashes, colons, commas and brackets, and newlines
+                    __attribute__((target("avx512f,avx512bw,avx512vl,aes,vaes")))
+                    static inline void JsonMasks(const char* aligned, Mask &structMask, Mask &newlineMask) {
+                        u8x64 block = _mm512_load_si512(aligned);
+                        structMask = 0;
+                        for (char c: {'"', '\\', ':', ',', '{', '}', '[', ']'}) {
+                            structMask |= _mm512_cmpeq_epi8_mask(block, _mm512_set1_epi8(c));
+                        }
+                        newlineMask = _mm512_cmpeq_epi8_mask(block, _mm512_set1_epi8('\n'));
+                    }
+                };
+
+                // Hashes four 16-byte blocks at a time with VAES
+                struct AesBlocks {
+                    // Bytes to load and 64-bit lanes holding a block, for tmpLen bytes left
+                    __attribute__((target("avx512f,avx512bw,avx512vl,aes,vaes")))
+                    static inline void BlockMasks(u32 tmpLen, __mmask64 &byteMask, __mmask8 &laneMask) {
+                        byteMask = tmpLen >= 64 ? ~0ULL : (1ULL << tmpLen) - 1;
+                        u32 blocks = std::min((tmpLen + 15) / 16, 4u);
+                        laneMask = (1u << (2 * blocks)) - 1;
+                    }
+
+                    __attribute__((target("avx512f,avx512bw,avx512vl,aes,vaes")))
+                    static inline u8x16 FoldLanes(u8x64 acc) {
+                        u8x16 lanes01 = _mm_xor_si128(_mm512_extracti32x4_epi32(acc, 0), _mm512_extracti32x4_epi32(acc, 1));
+                        u8x16 lanes23 = _mm_xor_si128(_mm512_extracti32x4_epi32(acc, 2), _mm512_extracti32x4_epi32(acc, 3));
+                        return _mm_xor_si128(lanes01, lanes23);
+                    }
+
+                    // Hashes the 128-byte groups of a long line in eight lanes held in two
+                    // registers, so that eight blocks are in flight in the AES unit. Advances
+                    // input, tmpLen and tweak past the hashed blocks.
+                    template <bool Tweaked>
+                    __attribute__((target("avx512f,avx512bw,avx512vl,aes,vaes")))
+                    static inline u8x64 HashLanes(const char* &input, u32 &tmpLen, u8x64 &tweak) {
+                        const u8x64 keys = _mm512_broadcast_i32x4(key);
+                        const u8x64 tweakStep = _mm512_set1_epi64(8);
+                        u8x64 tweak0 = tweak, tweak1 = _mm512_add_epi64(tweak, _mm512_set1_epi64(4));
+                        u8x64 acc0 = _mm512_setzero_si512(), acc1 = _mm512_setzero_si512();
+                        for (; tmpLen >= 128; tmpLen -= 128, input += 128) {
+                            u8x64 chunk0 = _mm512_loadu_si512(input);
+                            u8x64 chunk1 = _mm512_loadu_si512(input + 64);
+                            if (Tweaked) {
+                                chunk0 = _mm512_xor_si512(chunk0, tweak0);
+                                chunk1 = _mm512_xor_si512(chunk1, tweak1);
+                                tweak0 = _mm512_add_epi64(tweak0, tweakStep);
+                                tweak1 = _mm512_add_epi64(tweak1, tweakStep);
+                            }
+                            chunk0 = _mm512_aesenc_epi128(_mm512_aesenc_epi128(chunk0, keys), keys);
+                            chunk1 = _mm512_aesenc_epi128(_mm512_aesenc_epi128(chunk1, keys), keys);
+                            acc0 = _mm512_xor_si512(acc0, chunk0);
+                            acc1 = _mm512_xor_si512(acc1, chunk1);
+                        }
+                        tweak = tweak0;
+                        return _mm512_xor_si512(acc0, acc1);
+                    }
+
+                    __attribute__((target("avx512f,avx512bw,avx512vl,aes,vaes")))
+                    static inline void HashBlocks(const char* input, u32 len, u64 &hash) {
+                        // Short lines take a single 128-bit block
+                        if (len <= 16) {
+                            u8x16 chunk = _mm_maskz_loadu_epi8((__mmask16)((1u << len) - 1), input);
+                            chunk = _mm_aesenc_si128(chunk, key);
+                            chunk = _mm_aesenc_si128(chunk, key);
+                            hash = len == 0 ? 0 : _mm_extract_epi64(chunk, 0) ^ _mm_extract_epi64(chunk, 1);
+                            return;
+                        }
+                        const u8x64 keys = _mm512_broadcast_i32x4(key);
+                        u8x64 acc = _mm512_setzero_si512();
+                        u32 tmpLen = len;
+                        if (len >= LONG_HASH) {
+                            u8x64 tweak = keys;
+                            acc = HashLanes<false>(input, tmpLen, tweak);
+                        }
+                        for (; tmpLen > 0; tmpLen -= std::min(tmpLen, 64u), input += 64) {
+                            __mmask64 byteMask;
+                            __mmask8 laneMask;
+                            BlockMasks(tmpLen, byteMask, laneMask);
+                            u8x64 chunk = _mm512_maskz_loadu_epi8(byteMask, input);
+                            chunk = _mm512_aesenc_epi128(chunk, keys);
+                            chunk = _mm512_aesenc_epi128(chunk, keys);
+                            acc = _mm512_mask_xor_epi64(acc, laneMask, acc, chunk);
+                        }
+                        u8x16 folded = FoldLanes(acc);
+                        hash = _mm_extract_epi64(folded, 0) ^ _mm_extract_epi64(folded, 1);
+                    }
+
+                    __attribute__((target("avx512f,avx512bw,avx512vl,aes,vaes")))
+                    static inline void HashBlocks(const char* input, u32 len, WideHash &hash) {
+                        const u8x64 keys = _mm512_broadcast_i32x4(key);
+                        u8x64 tweak = _mm512_add_epi64(keys, _mm512_set_epi64(3, 3, 2, 2, 1, 1, 0, 0));
+                        const u8x64 tweakStep = _mm512_set1_epi64(4);
+                        u8x64 acc = _mm512_setzero_si512();
+                        u32 tmpLen = len;
+                        if (len >= LONG_HASH) {
+                            acc = HashLanes<true>(input, tmpLen, tweak);
+                        }
+                        for (; tmpLen > 0; tmpLen -= std::min(tmpLen, 64u), input += 64) {
+                            __mmask64 byteMask;
+                            __mmask8 laneMask;
+                            BlockMasks(tmpLen, byteMask, laneMask);
+                            u8x64 chunk = _mm512_maskz_loadu_epi8(byteMask, input);
+                            chunk = _mm512_aesenc_epi128(_mm512_xor_si512(chunk, tweak), keys);
+                            chunk = _mm512_aesenc_epi128(chunk, keys);
+                            acc = _mm512_mask_xor_epi64(acc, laneMask, acc, chunk);
+                            tweak = _mm512_add_epi64(tweak, tweakStep);
+                        }
+                        u8x16 state = _mm_xor_si128(FoldLanes(acc), _mm_set_epi64x(len, len));
+                        state = _mm_aesenc_si128(state, key);
+                        hash.lo = _mm_extract_epi64(state, 0);
+                        hash.hi = _mm_extract_epi64(state, 1);
+                    }
+                };
+
+                struct Isa : BlockScan<Blocks>, AesBlocks {};
+
+                // Entry points of the kernel. Everything they call is inlined into them, and so
+                // compiled for the instruction set of the kernel.
+                __attribute__((target("avx512f,avx512bw,avx512vl,aes,vaes"), flatten))
+                u32 FindLineLen(const char* input) {
+                    return Isa::FindLineLen(input);
+                }
+
+                template <typename HashValue>
+                __attribute__((target("avx512f,avx512bw,avx512vl,aes,vaes"), flatten))
+                void Hash(const char* input, HashValue &hash, u32 &len) {
+                    Kernel::Hash<Isa>(input, hash, len);
+                }
+
+                template <typename HashValue>
+                __attribute__((target("avx512f,avx512bw,avx512vl,aes,vaes"), flatten))
+                u32 HashLines(const char* input, const char* end, HashValue* hashes, u32* lens, u32 maxLines) {
+                    return Kernel::HashLines<Isa>(input, end, hashes, lens, maxLines);
+                }
+
+                template <typename HashValue>
+                __attribute__((target("avx512f,avx512bw,avx512vl,aes,vaes"), flatten))
+                u32 HashKeyLines(const char* input, const char* end, HashValue* hashes, u32* lens, u32 maxLines, const KeySpec &key) {
+                    return Kernel::HashKeyLines<Isa>(input, end, hashes, lens, maxLines, key);
+                }
+            }
+        }
+
+        enum class KernelIsa {
+            Scalar,
+            SSE42,
+            AVX2,
+            AVX512
+        };
+
+        struct HashKernel {
+            KernelIsa isa;
+            u32 (*findLineLen)(const char*);
+            void (*hash64)(const char*, u64&, u32&);
+            void (*hash128)(const char*, WideHash&, u32&);
+            u32 (*hashLines64)(const char*, const char*, u64*, u32*, u32);
+            u32 (*hashLines128)(const char*, const char*, WideHash*, u32*, u32);
+            u32 (*hashKeyLines64)(const char*, const char*, u64*, u32*, u32, const KeySpec&);
+            u32 (*hashKeyLines128)(const char*, const char*, WideHash*, u32*, u32, const KeySpec&);
+        };
+
+        inline HashKernel MakeKernel(KernelIsa isa) {
+            switch (isa) {
+            case KernelIsa::AVX512:
+                return {isa, Kernel::AVX512::FindLineLen, Kernel::AVX512::Hash<u64>, Kernel::AVX512::Hash<WideHash>,
+                    Kernel::AVX512::HashLines<u64>, Kernel::AVX512::HashLines<WideHash>,
+                    Kernel::AVX512::HashKeyLines<u64>, Kernel::AVX512::HashKeyLines<WideHash>};
+            case KernelIsa::AVX2:
+                return {isa, Kernel::AVX2::FindLineLen, Kernel::AVX2::Hash<u64>, Kernel::AVX2::Hash<WideHash>,
+                    Kernel::AVX2::HashLines<u64>, Kernel::AVX2::HashLines<WideHash>,
+                    Kernel::AVX2::HashKeyLines<u64>, Kernel::AVX2::HashKeyLines<WideHash>};
+            case KernelIsa::SSE42:
+                return {isa, Kernel::SSE42::FindLineLen, Kernel::SSE42::Hash<u64>, Kernel::SSE42::Hash<WideHash>,
+                    Kernel::SSE42::HashLines<u64>, Kernel::SSE42::HashLines<WideHash>,
+                    Kernel::SSE42::HashKeyLines<u64>, Kernel::SSE42::HashKeyLines<WideHash>};
+            default:
+                return {KernelIsa::Scalar, Kernel::Scalar::FindLineLen, Kernel::Scalar::Hash<u64>, Kernel::Scalar::Hash<WideHash>,
+                    Kernel::Scalar::HashLines<u64>, Kernel::Scalar::HashLines<WideHash>,
+                    Kernel::Scalar::HashKeyLines<u64>, Kernel::Scalar::HashKeyLines<WideHash>};
+            }
+        }
+
+        inline bool IsaSupported(KernelIsa isa) {
+            __builtin_cpu_init();
+            switch (isa) {
+            case KernelIsa::AVX512:
+                return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")
+                    && __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("aes")
+                    && __builtin_cpu_supports("vaes");
+            case KernelIsa::AVX2:
+                return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("aes");
+            case KernelIsa::SSE42:
+                return __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("aes");
+            default:
+                return true;
+            }
+        }
+
+        inline KernelIsa DetectIsa() {
+            for (KernelIsa isa: {KernelIsa::AVX512, KernelIsa::AVX2, KernelIsa::SSE42}) {
+                if (IsaSupported(isa)) return isa;
+            }
+            return KernelIsa::Scalar;
+        }
+
+        // Selected through CPUID once at startup
+        inline HashKernel ActiveKernel = MakeKernel(DetectIsa());
+
+        // Selects another kernel, e.g. to compare them. Not thread-safe.
+        inline void SetKernel(KernelIsa isa) {
+            ActiveKernel = MakeKernel(isa);
+        }
+
+        inline u32 FindLineLen(const char* input) {
+            return ActiveKernel.findLineLen(input);
+        }
+
+        inline void Hash(const char* input, u64 &hash, u32 &len) {
+            ActiveKernel.hash64(input, hash, len);
+        }
+
+        inline void Hash(const char* input, WideHash &hash, u32 &len) {
+            ActiveKernel.hash128(input, hash, len);
+        }
+
+        // Batched version of Hash, which saves the indirect call per line
+        inline u32 HashLines(const char* input, const char* end, u64* hashes, u32* lens, u32 maxLines) {
+            return ActiveKernel.hashLines64(input, end, hashes, lens, maxLines);
+        }
+
+        inline u32 HashLines(const char* input, const char* end, WideHash* hashes, u32* lens, u32 maxLines) {
+            return ActiveKernel.hashLines128(input, end, hashes, lens, maxLines);
+        }
+
+        // Same as HashLines, but hashes only the key of each line when key is given
+        inline u32 HashLines(const char* input, const char* end, u64* hashes, u32* lens, u32 maxLines, const KeySpec* key) {
+            if (key == nullptr) return ActiveKernel.hashLines64(input, end, hashes, lens, maxLines);
+            return ActiveKernel.hashKeyLines64(input, end, hashes, lens, maxLines, *key);
+        }
+
+        inline u32 HashLines(const char* input, const char* end, WideHash* hashes, u32* lens, u32 maxLines, const KeySpec* key) {
+            if (key == nullptr) return ActiveKernel.hashLines128(input, end, hashes, lens, maxLines);
+            return ActiveKernel.hashKeyLines128(input, end, hashes, lens, maxLines, *key);
+        }
+
+        // write(2) transfers at most about 2 GiB per call
+        void WriteAll(int fd, const char* buf, u64 len) {
+            while (len > 0) {
+                ssize_t written = write(fd, buf, len);
+                if (written == -1) {
+                    if (errno == EINTR) continue;
+                    perror("write");
+                    exit(1);
+                }
+                buf += written;
+                len -= written;
+            }
+        }
+
+        // Runs shorter than this are copied, since a writev entry or a spliced page costs
+        // more than copying a few lines
+        constexpr u64 ZERO_COPY_MIN_RUN = 4096;
+        constexpr u32 OUTPUT_BATCH_RUNS = 1024;
+        constexpr u64 OUTPUT_BATCH_COPIED = 1 << 20;
+
+        // True if fd is a pipe, into which vmsplice can map the pages of the input
+        bool IsPipe(int fd) {
+            struct stat fdStat;
+            return fstat(fd, &fdStat) == 0 && S_ISFIFO(fdStat.st_mode);
+        }
+
+        // Writes iov[0, iovNum) with writev, or with vmsplice when splice is set.
+        // Partially written entries are resumed.
+        void WriteIov(int fd, iovec* iov, u64 iovNum, bool splice) {
+            while (iovNum > 0) {
+                int batch = std::min(iovNum, (u64)IOV_MAX);
+                ssize_t written = splice ? vmsplice(fd, iov, batch, 0) : writev(fd, iov, batch);
+                if (written == -1) {
+                    if (errno == EINTR) continue;
+                    perror(splice ? "vmsplice" : "writev");
+                    exit(1);
+                }
+                for (; iovNum > 0 && (u64)written >= iov->iov_len; iov++, iovNum--) {
+                    written -= iov->iov_len;
+                }
+                if (written > 0) {
+                    iov->iov_base = (char*)iov->iov_base + written;
+                    iov->iov_len -= written;
+                }
+            }
+        }
+
+        // Unique lines to be written. Lines following each other in the input are
+        // coalesced into a run, and long runs are written straight from the input
+        // instead of being copied. Short runs are copied into a buffer.
+        class OutputRuns {
+            struct Run {
+                const char* ptr;    // Offset in copied if the run was copied
+                u64 len;
+                bool copied;
+            };
+            std::vector<Run> runs;
+            std::vector<char> copied;
+            const char* pendingPtr = nullptr;
+            u64 pendingLen = 0;
+            bool splice;
+
+            void FinishPending() {
+                if (pendingLen >= ZERO_COPY_MIN_RUN) {
+                    runs.push_back({pendingPtr, pendingLen, false});
+                } else if (pendingLen > 0) {
+                    u64 offset = copied.size();
+                    copied.insert(copied.end(), pendingPtr, pendingPtr + pendingLen);
+                    if (!runs.empty() && runs.back().copied) {
+                        runs.back().len += pendingLen;
+                    } else {
+                        runs.push_back({(const char*)offset, pendingLen, true});
+                    }
+                }
+                pendingLen = 0;
+            }
+        public:
+            // vmsplice leaves the pages referenced by the pipe until they are read, so
+            // splice may only be set when the input is never overwritten (i.e. a mapping).
+            // Copied runs are always written with writev.
+            OutputRuns(bool splice = false) : splice(splice) {}
+
+            bool Full() const {
+                return runs.size() >= OUTPUT_BATCH_RUNS || copied.size() >= OUTPUT_BATCH_COPIED;
+            }
+
+            // Adds a line and the newline following it
+            void Add(const char* line, u32 len) {
+                if (pendingPtr + pendingLen != line) {
+                    FinishPending();
+                    pendingPtr = line;
+                }
+                pendingLen += len + 1;
+            }
+
+            void Write(int fd) {
+                FinishPending();
+                std::vector<iovec> iov;
+                for (u64 i = 0; i < runs.size(); ) {
+                    bool copiedRuns = runs[i].copied;
+                    iov.clear();
+                    for (; i < runs.size() && runs[i].copied == copiedRuns; i++) {
+                        const char* ptr = copiedRuns ? copied.data() + (u64)runs[i].ptr : runs[i].ptr;
+                        iov.push_back({(void*)ptr, runs[i].len});
+                    }
+                    WriteIov(fd, iov.data(), iov.size(), splice && !copiedRuns);
+                }
+                runs.clear();
+                copied.clear();
+            }
+        };
+
+        template <typename Table>
+        std::vector<std::pair<const char*, u32>> ProcessChunkVec(
+            Table &ht,
+            const char* inputChunk,
+            u64 chunkLen,
+            const KeySpec* key = nullptr
+        ) {
+            using Traits = KeyTraits<typename Table::KeyType>;
+            const char* currentPtr = inputChunk;
+
+            typename Traits::HashType hashBuffer[BATCHSIZE];
+            u32 lenBuffer[BATCHSIZE];
+            const char* ptrBuffer[BATCHSIZE];
+
+            std::vector<std::pair<const char*, u32>> uniqueStrings;
+
+            while (currentPtr < inputChunk + chunkLen) {
+                // Batchfy hashing & inserting
+                u32 bufLen = HashLines(currentPtr, inputChunk + chunkLen, hashBuffer, lenBuffer, BATCHSIZE, key);
+                u32 i;
+                for (i = 0; i < bufLen; i++) {
+                    ptrBuffer[i] = currentPtr;
+                    currentPtr += lenBuffer[i] + 1;
+                }
+
+                for (i = 0; i < bufLen; i++) {
+                    if (i + PREFETCH_STRIDE < bufLen) {
+                        u32 j = i + PREFETCH_STRIDE;
+                        ht.Prefetch(Traits::Make(hashBuffer[j], ptrBuffer[j], lenBuffer[j]));
+                    }
+                    if (ht.Insert(Traits::Make(hashBuffer[i], ptrBuffer[i], lenBuffer[i]))) {
+                        uniqueStrings.emplace_back(ptrBuffer[i], lenBuffer[i]);
+                    }
+                }
+            }
+
+            return uniqueStrings;
+        }
+
+        // Only inserts the lines of the chunk, for counting them
+        template <typename Table>
+        void InsertChunk(Table &ht, const char* inputChunk, u64 chunkLen, const KeySpec* key = nullptr) {
+            using Traits = KeyTraits<typename Table::KeyType>;
+            const char* currentPtr = inputChunk;
+
+            typename Traits::HashType hashBuffer[BATCHSIZE];
+            u32 lenBuffer[BATCHSIZE];
+            const char* ptrBuffer[BATCHSIZE];
+
+            while (currentPtr < inputChunk + chunkLen) {
+                u32 bufLen = HashLines(currentPtr, inputChunk + chunkLen, hashBuffer, lenBuffer, BATCHSIZE, key);
+                u32 i;
+                for (i = 0; i < bufLen; i++) {
+                    ptrBuffer[i] = currentPtr;
+                    currentPtr += lenBuffer[i] + 1;
+                }
+
+                for (i = 0; i < bufLen; i++) {
+                    if (i + PREFETCH_STRIDE < bufLen) {
+                        u32 j = i + PREFETCH_STRIDE;
+                        ht.Prefetch(Traits::Make(hashBuffer[j], ptrBuffer[j], lenBuffer[j]));
+                    }
+                    ht.Insert(Traits::Make(hashBuffer[i], ptrBuffer[i], lenBuffer[i]));
+                }
+            }
+        }
+
+        // Unique lines are written straight from the input in batches of runs, so the
+        // input must stay valid until this returns
+        template <typename Table>
+        void ProcessChunk(
+            Table &ht, 
+            const char* inputChunk, 
+            u64 chunkLen, 
+            std::mutex &stdoutMutex,
+            bool splice = false,
+            const KeySpec* key = nullptr
+        ) {
+            using Traits = KeyTraits<typename Table::KeyType>;
+            const char* currentPtr = inputChunk;
+
+            typename Traits::HashType hashBuffer[BATCHSIZE];
+            u32 lenBuffer[BATCHSIZE];
+            const char* ptrBuffer[BATCHSIZE];
+
+            OutputRuns output(splice);
+
+            while (currentPtr < inputChunk + chunkLen) {
+                // Batchfy hashing & inserting
+                u32 bufLen = HashLines(currentPtr, inputChunk + chunkLen, hashBuffer, lenBuffer, BATCHSIZE, key);
+                u32 i;
+                for (i = 0; i < bufLen; i++) {
+                    ptrBuffer[i] = currentPtr;
+                    currentPtr += lenBuffer[i] + 1;
+                }
+
+                for (i = 0; i < bufLen; i++) {
+                    if (i + PREFETCH_STRIDE < bufLen) {
+                        u32 j = i + PREFETCH_STRIDE;
+                        ht.Prefetch(Traits::Make(hashBuffer[j], ptrBuffer[j], lenBuffer[j]));
+                    }
+                    if (ht.Insert(Traits::Make(hashBuffer[i], ptrBuffer[i], lenBuffer[i]))) {
+                        output.Add(ptrBuffer[i], lenBuffer[i]);
+                    }
+                }
+
+                if (output.Full()) {
+                    std::unique_lock<std::mutex> lock(stdoutMutex);
+                    output.Write(STDOUT_FILENO);
+                }
+            }
+
+            std::unique_lock<std::mutex> lock(stdoutMutex);
+            output.Write(STDOUT_FILENO);
+        }
+
+        const char* ClosestNewline(const char* input, const char* end) {
+            while(input < end && *input != '\n') input++;
+            return input;
+        }
+
+        // Divide the input equally
+        std::vector<std::pair<const char*, u64>> DivideInput(
+            const char* beg, const char* end, u32 threadNum
+        ) {
+            u64 fileSize = end - beg;
+            u64 perChunkLen = fileSize / threadNum;
+
+            std::vector<std::pair<const char*, u64>> ret;
+
+            const char* prev = beg;
+            u32 i = 0;
+            for (; i < threadNum; i++) {
+                if (i == threadNum - 1) {
+                    ret.push_back(std::make_pair(prev, (u64)(end - prev)));
+                } else {
+                    const char* next = ClosestNewline(prev + perChunkLen, end);
+                    if (next == end) {
+                        ret.push_back(std::make_pair(prev, (u64)(end - prev)));
+                        break;
+                    } else {
+                        ret.push_back(std::make_pair(prev, (u64)((next + 1) - prev)));
+                        prev = next + 1;
+                    }
+                }
+            }
+
+            if (i != threadNum) {
+                for (; i < threadNum; i++) {
+                    ret.push_back(std::make_pair((const char*)NULL, (u64)0)); // Just add an empty chunk
+                }
+            }
+
+            return ret;
+        }
+
+        // Splits [beg, end) into chunks of about chunkSize bytes, each ending with a newline
+        // (except the last one) and appends them to chunks
+        void SplitInput(
+            const char* beg, const char* end, u64 chunkSize,
+            std::vector<std::pair<const char*, u64>> &chunks
+        ) {
+            const char* prev = beg;
+            while ((u64)(end - prev) > chunkSize) {
+                const char* next = ClosestNewline(prev + chunkSize, end);
+                if (next == end) break;
+                chunks.emplace_back(prev, (u64)((next + 1) - prev));
+                prev = next + 1;
+            }
+            if (prev < end) {
+                chunks.emplace_back(prev, (u64)(end - prev));
+            }
+        }
+
+        // The engines sharing one table take the input in work units of WORK_UNIT_MIN to
+        // WORK_UNIT_MAX bytes, about WORK_UNITS_PER_THREAD per thread
+        constexpr u64 WORK_UNIT_MIN = 64 << 10;
+        constexpr u64 WORK_UNIT_MAX = 4 << 20;
+        constexpr u64 WORK_UNITS_PER_THREAD = 16;
+
+        // Size of the work units, overriding the one derived from the input when not 0.
+        // A size of at least the input divided by the number of threads gives every
+        // thread a single unit, as the static split did.
+        inline u64 WorkUnitSize = 0;
+
+        std::vector<std::pair<const char*, u64>> SplitWork(const char* beg, const char* end, u32 threadNum) {
+            u64 unitSize = WorkUnitSize;
+            if (unitSize == 0) {
+                unitSize = std::clamp((u64)(end - beg) / (threadNum * WORK_UNITS_PER_THREAD), WORK_UNIT_MIN, WORK_UNIT_MAX);
+            }
+            std::vector<std::pair<const char*, u64>> units;
+            SplitInput(beg, end, unitSize, units);
+            return units;
+        }
+
+        // Hands out work units to the threads. Each thread starts with a contiguous range
+        // of units, which keeps its reads sequential, and takes units from the front of it.
+        // A thread whose range is empty steals from the back of the largest range left,
+        // so a region with longer lines, more unique strings or colder pages does not
+        // keep one thread busy while the others wait. With several NUMA nodes, ranges of
+        // threads on the same node are stolen from first.
+        class WorkQueue {
+            // Head in the low 32 bits and tail in the high 32 bits, updated with CAS
+            struct alignas(64) Range {
+                std::atomic<u64> bounds;
+            };
+            const std::vector<std::pair<const char*, u64>> &units;
+            std::vector<Range> ranges;
+            u32 nodeNum;
+
+            static inline u64 Pack(u32 head, u32 tail) {
+                return ((u64)tail << 32) | head;
+            }
+        public:
+            WorkQueue(const std::vector<std::pair<const char*, u64>> &units, u32 threadNum, u32 nodeNum = 1)
+                : units(units), ranges(threadNum), nodeNum(nodeNum) {
+                for (u32 t = 0; t < threadNum; t++) {
+                    ranges[t].bounds = Pack(units.size() * t / threadNum, units.size() * (t + 1) / threadNum);
+                }
+            }
+
+            // Returns false once every unit has been taken
+            bool Next(u32 threadId, std::pair<const char*, u64> &unit) {
+                std::atomic<u64> &own = ranges[threadId].bounds;
+                u64 bounds = own.load();
+                while ((u32)bounds < (u32)(bounds >> 32)) {
+                    u32 head = bounds, tail = bounds >> 32;
+                    if (own.compare_exchange_weak(bounds, Pack(head + 1, tail))) {
+                        unit = units[head];
+                        return true;
+                    }
+                }
+
+                u32 threadNum = ranges.size();
+                u32 node = (u64)threadId * nodeNum / threadNum;
+                bool local = nodeNum > 1;
+                while (true) {
+                    u32 victim = 0, victimLeft = 0;
+                    for (u32 t = 0; t < threadNum; t++) {
+                        if (local && (u64)t * nodeNum / threadNum != node) continue;
+                        u64 victimBounds = ranges[t].bounds.load();
+                        u32 left = (u32)(victimBounds >> 32) - std::min((u32)victimBounds, (u32)(victimBounds >> 32));
+                        if (left > victimLeft) {
+                            victim = t;
+                            victimLeft = left;
+                        }
+                    }
+                    if (victimLeft == 0) {
+                        if (!local) return false;
+                        local = false;
+                        continue;
+                    }
+
+                    std::atomic<u64> &other = ranges[victim].bounds;
+                    u64 victimBounds = other.load();
+                    u32 head = victimBounds, tail = victimBounds >> 32;
+                    if (head < tail && other.compare_exchange_strong(victimBounds, Pack(head, tail - 1))) {
+                        unit = units[tail - 1];
+                        return true;
+                    }
+                }
+            }
+        };
+
+        // Faults in the units each thread starts with from the node of the thread, and
+        // migrates those already cached on another node. The input has to be mapped
+        // without MAP_POPULATE, which would fault every page in from the calling thread.
+        // Adjacent units are placed as one range, and the units of different files are
+        // placed separately, since their mappings are not contiguous.
+        void PlaceInput(const std::vector<std::pair<const char*, u64>> &units, u32 threadNum) {
+            omp_set_num_threads(threadNum);
+            #pragma omp parallel
+            {
+                int threadId = omp_get_thread_num();
+                NodeAffinity affinity(true, threadId, threadNum);
+                int node = NumaNodes()[ThreadNode(threadId, threadNum)].id;
+                u64 first = units.size() * threadId / threadNum;
+                u64 last = units.size() * (threadId + 1) / threadNum;
+                for (u64 i = first; i < last;) {
+                    const char* beg = units[i].first;
+                    const char* end = beg + units[i].second;
+                    for (i++; i < last && units[i].first == end; i++) {
+                        end += units[i].second;
+                    }
+                    // The volatile load is what faults the page in
+                    for (const char* p = beg; p < end; p += NUMA_PAGE_SIZE) {
+                        (void)*(volatile const char*)p;
+                    }
+                    BindToNode(beg, end - beg, node, true);
+                }
+            }
+        }
+
+        template <typename Table>
+        std::vector<std::vector<std::pair<const char*, u32>>> RunChunksVec(
+            Table &ht,
+            const std::vector<std::pair<const char*, u64>> &units,
+            u32 threadNum,
+            bool numa = false,
+            const KeySpec* key = nullptr
+        ) {
+            std::vector<std::vector<std::pair<const char*, u32>>> results(threadNum);
+            WorkQueue queue(units, threadNum, numa ? NumaNodes().size() : 1);
+
+            omp_set_num_threads(threadNum);
+            #pragma omp parallel
+            {
+                int threadId = omp_get_thread_num();
+                NodeAffinity affinity(numa, threadId, threadNum);
+                std::pair<const char*, u64> unit;
+                while (queue.Next(threadId, unit)) {
+                    auto uniqueStrings = ProcessChunkVec(ht, unit.first, unit.second, key);
+                    results[threadId].insert(results[threadId].end(), uniqueStrings.begin(), uniqueStrings.end());
+                }
+            }
+
+            return results;
+        }
+
+        template <typename Table>
+        void RunChunks(
+            Table &ht,
+            const std::vector<std::pair<const char*, u64>> &units,
+            u32 threadNum,
+            bool numa = false,
+            const KeySpec* key = nullptr
+        ) {
+            std::mutex stdoutMutex;
+            // The units are parts of a read-only mapping, which vmsplice can hand to a pipe
+            bool splice = IsPipe(STDOUT_FILENO);
+            WorkQueue queue(units, threadNum, numa ? NumaNodes().size() : 1);
+
+            omp_set_num_threads(threadNum);
+            #pragma omp parallel 
+            {
+                int threadId = omp_get_thread_num();
+                NodeAffinity affinity(numa, threadId, threadNum);
+                std::pair<const char*, u64> unit;
+                while (queue.Next(threadId, unit)) {
+                    ProcessChunk(ht, unit.first, unit.second, stdoutMutex, splice, key);
+                }
+            }
+        }
+
+        template <typename Table>
+        void RunChunksInsert(
+            Table &ht,
+            const std::vector<std::pair<const char*, u64>> &units,
+            u32 threadNum,
+            bool numa = false,
+            const KeySpec* key = nullptr
+        ) {
+            WorkQueue queue(units, threadNum, numa ? NumaNodes().size() : 1);
+
+            omp_set_num_threads(threadNum);
+            #pragma omp parallel
+            {
+                int threadId = omp_get_thread_num();
+                NodeAffinity affinity(numa, threadId, threadNum);
+                std::pair<const char*, u64> unit;
+                while (queue.Next(threadId, unit)) {
+                    InsertChunk(ht, unit.first, unit.second, key);
+                }
+            }
+        }
+
+        // Maps the regular files among paths and returns their mappings. Empty files and
+        // paths which are not regular files (e.g. directories) are skipped.
+        std::vector<std::pair<const char*, u64>> MapFiles(
+            const std::vector<std::string> &paths, bool numa, bool hugePages
+        ) {
+            std::vector<std::pair<const char*, u64>> mappings;
+            for (auto &path: paths) {
+                int fd = open(path.data(), O_RDONLY);
+                if (fd == -1) {
+                    perror(path.data());
+                    exit(1);
+                }
+                struct stat fileStat;
+                fstat(fd, &fileStat);
+                u64 fileSize = fileStat.st_size;
+                if (!S_ISREG(fileStat.st_mode) || fileSize == 0) {
+                    close(fd);
+                    continue;
+                }
+
+                const char* input = MapInput(fd, fileSize, numa, hugePages);
+                if (input == MAP_FAILED) {
+                    perror("mmap");
+                    close(fd);
+                    exit(1);
+                }
+                // The mapping stays valid after the file is closed, so thousands of
+                // files do not run out of descriptors
+                close(fd);
+                mappings.emplace_back(input, fileSize);
+            }
+            return mappings;
+        }
+
+        constexpr u32 PARTITION_BITS = 8;
+        constexpr u32 PARTITION_NUM = 1 << PARTITION_BITS;
+        constexpr u32 RECENT_CACHE_SIZE = 4096;
+
+        inline u32 CalcPartitionIdx(u64 hash) {
+            return hash >> (64 - PARTITION_BITS);
+        }
+
+        template <typename Key>
+        using PartitionRecord = LineRecord<typename KeyTraits<Key>::HashType>;
+
+        // The scattered records get half of the memory limit and the tables of pass two the
+        // other half. A table may hold SPILL_TABLE_FACTOR slots per key while it is resized.
+        // SPILL_MIN_BUDGET keeps a tiny limit from making every batch a write and every
+        // key a round.
+        constexpr u64 SPILL_MIN_BUDGET = 1 << 16;
+        constexpr u64 SPILL_READ_RECORDS = 1 << 16;
+        constexpr u64 SPILL_TABLE_FACTOR = 6;
+
+        // Directory of the temporary files, like sort(1)
+        const char* TempDir() {
+            const char* dir = getenv("TMPDIR");
+            return (dir != nullptr && dir[0] != '\0') ? dir : "/tmp";
+        }
+
+        void PreadAll(int fd, char* buf, u64 len, u64 offset) {
+            while (len > 0) {
+                ssize_t readBytes = pread(fd, buf, len, offset);
+                if (readBytes == -1 && errno == EINTR) continue;
+                if (readBytes <= 0) {
+                    perror("pread");
+                    exit(1);
+                }
+                buf += readBytes;
+                len -= readBytes;
+                offset += readBytes;
+            }
+        }
+
+        // Records scattered by one thread which did not fit in the memory limit. The file
+        // is unlinked as soon as it is created, so it is removed when it is closed.
+        // The records still point into the input, which stays mapped.
+        template <typename Record>
+        class SpillFile {
+            int fd = -1;
+            u64 fileSize = 0;
+            // Offset and number of records of each write to a partition, in input order
+            std::vector<std::vector<std::pair<u64, u64>>> segments;
+
+            void Open() {
+                std::string path = std::string(TempDir()) + "/FastUniqXXXXXX";
+                fd = mkstemp(path.data());
+                if (fd == -1) {
+                    perror("mkstemp");
+                    exit(1);
+                }
+                unlink(path.data());
+            }
+        public:
+            SpillFile() : segments(PARTITION_NUM) {}
+            SpillFile(const SpillFile&) = delete;
+            SpillFile& operator=(const SpillFile&) = delete;
+
+            ~SpillFile() {
+                if (fd != -1) close(fd);
+            }
+
+            u64 Records(u32 p) const {
+                u64 records = 0;
+                for (auto &segment: segments[p]) {
+                    records += segment.second;
+                }
+                return records;
+            }
+
+            // Appends the records of every partition to the file and empties the partitions
+            void Write(std::vector<std::vector<Record>> &partitions) {
+                if (fd == -1) Open();
+                for (u32 p = 0; p < PARTITION_NUM; p++) {
+                    if (partitions[p].empty()) continue;
+                    u64 bytes = partitions[p].size() * sizeof(Record);
+                    WriteAll(fd, (const char*)partitions[p].data(), bytes);
+                    segments[p].emplace_back(fileSize, partitions[p].size());
+                    fileSize += bytes;
+                    partitions[p].clear();
+                }
+            }
+
+            // Reads the records of partition p back in input order, buffer.size() records
+            // at a time, and passes each batch to visit(records, num)
+            template <typename Visit>
+            void ForEach(u32 p, std::vector<Record> &buffer, Visit visit) const {
+                for (auto &segment: segments[p]) {
+                    for (u64 done = 0; done < segment.second; ) {
+                        u64 num = std::min(segment.second - done, (u64)buffer.size());
+                        PreadAll(fd, (char*)buffer.data(), num * sizeof(Record), segment.first + done * sizeof(Record));
+                        visit(buffer.data(), num);
+                        done += num;
+                    }
+                }
+            }
+        };
+
+        // Round of pass two in which a key is inserted, when a partition is deduplicated
+        // in rounds. Uses the low hash bits, which neither the partition nor the slot uses.
+        inline u32 SpillRound(u64 hash, u32 rounds) {
+            return ((hash & 0xffffffff) * rounds) >> 32;
+        }
+
+        // Concatenates the unique lines of one chunk found in each partition and sorts them
+        // by address, which is their order in the input.
+        template <typename Line>
+        void GatherInOrder(std::vector<std::vector<Line>> &parts, std::vector<Line> &out) {
+            u64 uniqueCount = 0;
+            for (auto &part: parts) {
+                uniqueCount += part.size();
+            }
+            out.reserve(uniqueCount);
+            for (auto &part: parts) {
+                out.insert(out.end(), part.begin(), part.end());
+                std::vector<Line>().swap(part);
+            }
+            std::sort(out.begin(), out.end());
+        }
+
+        // Pass one of the partitioned strategy. Each line is scattered as its hash and a
+        // reference to it. Lines equal to a recently seen line of the same chunk are
+        // dropped here, since that earlier line already covers them.
+        // When spill is given, the records are written to it whenever spillRecords of
+        // them are held in memory.
+        template <typename Key = u64>
+        std::vector<std::vector<PartitionRecord<Key>>> ScatterChunk(
+            const char* inputChunk,
+            u64 chunkLen,
+            SpillFile<PartitionRecord<Key>>* spill = nullptr,
+            u64 spillRecords = 0,
+            const KeySpec* key = nullptr
+        ) {
+            using Traits = KeyTraits<Key>;
+            using Record = PartitionRecord<Key>;
+            std::vector<std::vector<Record>> partitions(PARTITION_NUM);
+            std::vector<Record> recent(RECENT_CACHE_SIZE, Record{});
+
+            typename Traits::HashType hashBuffer[BATCHSIZE];
+            u32 lenBuffer[BATCHSIZE];
+
+            const char* currentPtr = inputChunk;
+            u64 bufferedRecords = 0;
+            while (currentPtr < inputChunk + chunkLen) {
+                u32 bufLen = HashLines(currentPtr, inputChunk + chunkLen, hashBuffer, lenBuffer, BATCHSIZE, key);
+                for (u32 i = 0; i < bufLen; i++) {
+                    const auto &hash = hashBuffer[i];
+                    u32 len = lenBuffer[i];
+                    Key lineKey = Traits::Make(hash, currentPtr, len);
+                    u64 hash64 = Traits::Hash(lineKey);
+                    Record &cached = recent[hash64 % RECENT_CACHE_SIZE];
+                    bool seen = cached.ref != 0
+                        && Traits::Equal(Traits::Make(cached.hash, cached.Ptr(), cached.Len()), lineKey);
+                    if (!seen) {
+                        cached = Record::Make(hash, currentPtr, len);
+                        partitions[CalcPartitionIdx(hash64)].push_back(cached);
+                        bufferedRecords++;
+                    }
+                    currentPtr += len + 1;
+                }
+
+                if (spill != nullptr && bufferedRecords >= spillRecords) {
+                    spill->Write(partitions);
+                    bufferedRecords = 0;
+                }
+            }
+
+            return partitions;
+        }
+
+        // Pass two of the partitioned strategy. Each partition is owned by one thread,
+        // so the tables need no synchronization.
+        // A partition receives the records of chunk 0 first, then chunk 1 and so on, so
+        // the line inserted first is always the first occurrence. When ordered is set, the
+        // unique lines are grouped by the chunk they lie in and sorted by their address,
+        // which makes results[i] the unique lines of chunk i in input order.
+        // When memoryLimit is set, the records are spilled to disk once they exceed half
+        // of it, and a partition whose table may not fit in the other half is deduplicated
+        // in rounds, each of which reads the records of the partition again but inserts
+        // only the keys of that round.
+        template <typename Key = u64>
+        std::vector<std::vector<std::pair<const char*, u32>>> RunPartitioned(
+            const std::vector<std::pair<const char*, u64>> &chunks,
+            u32 threadNum,
+            bool ordered = false,
+            u64 memoryLimit = 0,
+            bool numa = false,
+            bool hugePages = false,
+            const KeySpec* key = nullptr
+        ) {
+            using Traits = KeyTraits<Key>;
+            using Record = PartitionRecord<Key>;
+            std::vector<std::vector<std::vector<Record>>> scattered(threadNum);
+            std::vector<std::vector<std::pair<const char*, u32>>> results(threadNum);
+            std::vector<SpillFile<Record>> spills(memoryLimit > 0 ? threadNum : 0);
+            // Per thread, for the records and for a table each
+            u64 budget = std::max(memoryLimit / 2 / threadNum, SPILL_MIN_BUDGET);
+            u64 spillRecords = budget / sizeof(Record);
+            // Bytes of a table per key. Set after pass one
+            u64 keyBytes = 0;
+            // Unique lines of each partition, per source chunk. Only used when ordered
+            std::vector<std::vector<std::vector<std::pair<const char*, u32>>>> bySource;
+            if (ordered) {
+                bySource.assign(threadNum, std::vector<std::vector<std::pair<const char*, u32>>>(PARTITION_NUM));
+            }
+
+            omp_set_num_threads(threadNum);
+            #pragma omp parallel
+            {
+                int threadId = omp_get_thread_num();
+                // The scattered records and the tables of the partitions are first touched
+                // by the pinned thread, so they are allocated on its node
+                NodeAffinity affinity(numa, threadId, threadNum);
+                const char* beg = chunks[threadId].first;
+                u64 len = chunks[threadId].second;
+
+                if (len > 0) {
+                    SpillFile<Record>* spill = memoryLimit > 0 ? &spills[threadId] : nullptr;
+                    scattered[threadId] = ScatterChunk<Key>(beg, len, spill, spillRecords, key);
+                } else {
+                    scattered[threadId].resize(PARTITION_NUM);
+                }
+
+                #pragma omp barrier
+
+                #pragma omp single
+                if (memoryLimit > 0) {
+                    keyBytes = SPILL_TABLE_FACTOR * sizeof(Key);
+                    // The exact mode also copies the lines into the table. Lines dropped in
+                    // pass one make the average length an overestimate.
+                    if (std::is_same_v<Key, LineKey>) {
+                        u64 inputBytes = 0, records = 0;
+                        for (u32 t = 0; t < threadNum; t++) {
+                            inputBytes += chunks[t].second;
+                            for (u32 p = 0; p < PARTITION_NUM; p++) {
+                                records += scattered[t][p].size() + spills[t].Records(p);
+                            }
+                        }
+                        keyBytes += inputBytes / std::max(records, (u64)1);
+                    }
+                }
+
+                std::vector<Record> readBuffer(memoryLimit > 0 ? SPILL_READ_RECORDS : 0);
+
+                #pragma omp for schedule(dynamic)
+                for (u32 p = 0; p < PARTITION_NUM; p++) {
+                    // Every record may be a unique key, so a partition takes as many rounds
+                    // as its records need for the table to fit in the budget
+                    u32 rounds = 1;
+                    if (memoryLimit > 0) {
+                        u64 records = 0;
+                        for (u32 t = 0; t < threadNum; t++) {
+                            records += scattered[t][p].size() + spills[t].Records(p);
+                        }
+                        rounds = std::max((records * keyBytes + budget - 1) / budget, (u64)1);
+                    }
+
+                    for (u32 round = 0; round < rounds; round++) {
+                        HashTable<Key> table;
+                        table.SetHugePages(hugePages);
+                        for (u32 t = 0; t < threadNum; t++) {
+                            auto &uniqueStrings = ordered ? bySource[t][p] : results[threadId];
+                            auto insertRecords = [&](const Record* records, u64 num) {
+                                for (u64 i = 0; i < num; i++) {
+                                    if (i + PREFETCH_STRIDE < num) {
+                                        const Record &rec = records[i + PREFETCH_STRIDE];
+                                        table.Prefetch(Traits::Make(rec.hash, rec.Ptr(), 0));
+                                    }
+
+                                    const Record &rec = records[i];
+                                    if (rounds > 1 && SpillRound(Traits::Hash(Traits::Make(rec.hash, rec.Ptr(), 0)), rounds) != round) {
+                                        continue;
+                                    }
+                                    u32 lineLen = rec.Len();
+                                    if (table.Insert(Traits::Make(rec.hash, rec.Ptr(), lineLen))) {
+                                        uniqueStrings.emplace_back(rec.Ptr(), lineLen);
+                                    }
+                                }
+                            };
+                            // Spilled records precede the ones still in memory
+                            if (memoryLimit > 0) {
+                                spills[t].ForEach(p, readBuffer, insertRecords);
+                            }
+                            insertRecords(scattered[t][p].data(), scattered[t][p].size());
+                        }
+                    }
+
+                    for (u32 t = 0; t < threadNum; t++) {
+                        std::vector<Record>().swap(scattered[t][p]);
+                    }
+                }
+
+                // The implicit barrier of the loop above makes bySource complete here
+                if (ordered) {
+                    GatherInOrder(bySource[threadId], results[threadId]);
+                }
+            }
+
+            return results;
+        }
+
+        // When ordered is set, the buffers are written in the order of the threads
+        void WriteUniqueStrings(
+            const std::vector<std::vector<std::pair<const char*, u32>>> &uniqueStrings,
+            u32 threadNum,
+            bool ordered = false
+        ) {
+            std::mutex stdoutMutex;
+            // The strings point into a read-only mapping, which vmsplice can hand to a pipe
+            bool splice = IsPipe(STDOUT_FILENO);
+
+            omp_set_num_threads(threadNum);
+            #pragma omp parallel
+            {
+                int threadId = omp_get_thread_num();
+                OutputRuns output(splice);
+                for (auto &str: uniqueStrings[threadId]) {
+                    output.Add(str.first, str.second);
+                    if (!ordered && output.Full()) {
+                        std::unique_lock<std::mutex> lock(stdoutMutex);
+                        output.Write(STDOUT_FILENO);
+                    }
+                }
+
+                if (ordered) {
+                    #pragma omp for ordered schedule(static, 1)
+                    for (u32 t = 0; t < threadNum; t++) {
+                        #pragma omp ordered
+                        output.Write(STDOUT_FILENO);
+                    }
+                } else {
+                    std::unique_lock<std::mutex> lock(stdoutMutex);
+                    output.Write(STDOUT_FILENO);
+                }
+            }
+        }
+
+        // A unique line and the number of its occurrences
+        struct CountedLine {
+            const char* ptr;
+            u32 len;
+            u64 count;
+
+            bool operator<(const CountedLine &other) const {
+                return ptr < other.ptr;
+            }
+        };
+
+        template <typename Key>
+        struct CountRecord {
+            PartitionRecord<Key> line;
+            u64 count;
+        };
+
+        // Pass one of the count mode. Same as ScatterChunk, except that a line equal to a
+        // recently seen one increments the count of the record scattered for it. Hot lines
+        // of skewed inputs are mostly counted here, before they reach the tables.
+        template <typename Key = u64>
+        std::vector<std::vector<CountRecord<Key>>> ScatterChunkCounted(
+            const char* inputChunk,
+            u64 chunkLen,
+            const KeySpec* key = nullptr
+        ) {
+            using Traits = KeyTraits<Key>;
+            using Record = PartitionRecord<Key>;
+            struct CacheEntry {
+                Record line;
+                u32 partitionIdx;
+                u64 recordIdx;
+            };
+            std::vector<std::vector<CountRecord<Key>>> partitions(PARTITION_NUM);
+            std::vector<CacheEntry> recent(RECENT_CACHE_SIZE, CacheEntry{});
+
+            typename Traits::HashType hashBuffer[BATCHSIZE];
+            u32 lenBuffer[BATCHSIZE];
+
+            const char* currentPtr = inputChunk;
+            while (currentPtr < inputChunk + chunkLen) {
+                u32 bufLen = HashLines(currentPtr, inputChunk + chunkLen, hashBuffer, lenBuffer, BATCHSIZE, key);
+                for (u32 i = 0; i < bufLen; i++) {
+                    const auto &hash = hashBuffer[i];
+                    u32 len = lenBuffer[i];
+                    Key lineKey = Traits::Make(hash, currentPtr, len);
+                    u64 hash64 = Traits::Hash(lineKey);
+                    CacheEntry &cached = recent[hash64 % RECENT_CACHE_SIZE];
+                    bool seen = cached.line.ref != 0
+                        && Traits::Equal(Traits::Make(cached.line.hash, cached.line.Ptr(), cached.line.Len()), lineKey);
+                    if (seen) {
+                        partitions[cached.partitionIdx][cached.recordIdx].count++;
+                    } else {
+                        u32 partitionIdx = CalcPartitionIdx(hash64);
+                        cached = {Record::Make(hash, currentPtr, len), partitionIdx, partitions[partitionIdx].size()};
+                        partitions[partitionIdx].push_back({cached.line, 1});
+                    }
+                    currentPtr += len + 1;
+                }
+            }
+
+            return partitions;
+        }
+
+        // Pass two of the count mode. The tables map each line to the first record scattered
+        // for it, which adds up the counts of the later ones, and since a partition is owned
+        // by one thread, the counts need no atomics. No table of counted lines is built:
+        // once a partition is counted, visit(threadId, p, forEachLine) is called by the
+        // thread owning it, and forEachLine(f) calls f(t, line) for each line of the
+        // partition, in the order of first occurrence within the chunk t it was first seen
+        // in. After the partitions, finish(threadId) is called by every thread.
+        template <typename Key, typename Visit, typename Finish>
+        void CountPartitions(
+            const std::vector<std::pair<const char*, u64>> &chunks,
+            u32 threadNum,
+            Visit visit,
+            Finish finish,
+            const KeySpec* key = nullptr
+        ) {
+            using Traits = KeyTraits<KeyValue<Key>>;
+            std::vector<std::vector<std::vector<CountRecord<Key>>>> scattered(threadNum);
+
+            omp_set_num_threads(threadNum);
+            #pragma omp parallel
+            {
+                int threadId = omp_get_thread_num();
+                const char* beg = chunks[threadId].first;
+                u64 len = chunks[threadId].second;
+
+                if (len > 0) {
+                    scattered[threadId] = ScatterChunkCounted<Key>(beg, len, key);
+                } else {
+                    scattered[threadId].resize(PARTITION_NUM);
+                }
+
+                #pragma omp barrier
+
+                #pragma omp for schedule(dynamic)
+                for (u32 p = 0; p < PARTITION_NUM; p++) {
+                    HashTable<KeyValue<Key>> table;
+                    for (u32 t = 0; t < threadNum; t++) {
+                        std::vector<CountRecord<Key>> &records = scattered[t][p];
+                        for (u64 i = 0; i < records.size(); i++) {
+                            if (i + PREFETCH_STRIDE < records.size()) {
+                                const auto &rec = records[i + PREFETCH_STRIDE].line;
+                                table.Prefetch(Traits::Make(rec.hash, rec.Ptr(), 0));
+                            }
+
+                            auto &rec = records[i];
+                            KeyValue<Key> lineKey = Traits::Make(rec.line.hash, rec.line.Ptr(), rec.line.Len());
+                            lineKey.value = (u64)&rec;
+                            bool inserted;
+                            KeyValue<Key> &slot = table.FindOrInsert(lineKey, inserted);
+                            if (!inserted) {
+                                // A count of zero marks the records which are not the first
+                                ((CountRecord<Key>*)slot.value)->count += rec.count;
+                                rec.count = 0;
+                            }
+                        }
+                    }
+
+                    visit(threadId, p, [&](auto f) {
+                        for (u32 t = 0; t < threadNum; t++) {
+                            for (auto &rec: scattered[t][p]) {
+                                if (rec.count > 0) f(t, CountedLine{rec.line.Ptr(), rec.line.Len(), rec.count});
+                            }
+                        }
+                    });
+                    for (u32 t = 0; t < threadNum; t++) {
+                        std::vector<CountRecord<Key>>().swap(scattered[t][p]);
+                    }
+                }
+
+                finish(threadId);
+            }
+        }
+
+        template <typename Key = u64>
+        std::vector<std::vector<CountedLine>> RunCounting(
+            const std::vector<std::pair<const char*, u64>> &chunks,
+            u32 threadNum,
+            bool ordered = false,
+            const KeySpec* key = nullptr
+        ) {
+            std::vector<std::vector<CountedLine>> results(threadNum);
+            std::vector<std::vector<std::vector<CountedLine>>> bySource;
+            if (ordered) {
+                bySource.assign(threadNum, std::vector<std::vector<CountedLine>>(PARTITION_NUM));
+            }
+
+            CountPartitions<Key>(chunks, threadNum,
+                [&](int threadId, u32 p, auto forEachLine) {
+                    if (ordered) {
+                        forEachLine([&](u32 t, const CountedLine &line) { bySource[t][p].push_back(line); });
+                    } else {
+                        forEachLine([&](u32 /* t */, const CountedLine &line) { results[threadId].push_back(line); });
+                    }
+                },
+                [&](int threadId) {
+                    // The implicit barrier of the partition loop makes bySource complete here
+                    if (ordered) {
+                        GatherInOrder(bySource[threadId], results[threadId]);
+                    }
+                },
+                key
+            );
+
+            return results;
+        }
+
+        // Lines with higher counts come first. Ties are broken by the position in the
+        // input, so that the result does not depend on the number of threads.
+        inline bool MoreFrequent(const CountedLine &a, const CountedLine &b) {
+            return a.count > b.count || (a.count == b.count && a.ptr < b.ptr);
+        }
+
+        // Each thread keeps the k most frequent lines of the partitions it owns in a heap
+        // whose top is the least frequent of them, so most lines are rejected with a single
+        // comparison. The lines go from the counted records straight into the heap, and
+        // only the threadNum heaps are merged at the end.
+        template <typename Key = u64>
+        std::vector<CountedLine> RunTopK(
+            const std::vector<std::pair<const char*, u64>> &chunks,
+            u32 k,
+            u32 threadNum,
+            const KeySpec* key = nullptr
+        ) {
+            std::vector<std::vector<CountedLine>> heaps(threadNum);
+            if (k == 0) return {};
+
+            CountPartitions<Key>(chunks, threadNum,
+                [&](int threadId, u32 /* p */, auto forEachLine) {
+                    auto &heap = heaps[threadId];
+                    forEachLine([&](u32 /* t */, const CountedLine &line) {
+                        if (heap.size() < k) {
+                            heap.push_back(line);
+                            std::push_heap(heap.begin(), heap.end(), MoreFrequent);
+                        } else if (MoreFrequent(line, heap.front())) {
+                            std::pop_heap(heap.begin(), heap.end(), MoreFrequent);
+                            heap.back() = line;
+                            std::push_heap(heap.begin(), heap.end(), MoreFrequent);
+                        }
+                    });
+                },
+                [](int /* threadId */) {},
+                key
+            );
+
+            std::vector<CountedLine> topK;
+            for (auto &heap: heaps) {
+                topK.insert(topK.end(), heap.begin(), heap.end());
+            }
+            u32 resultSize = std::min((u64)k, (u64)topK.size());
+            std::partial_sort(topK.begin(), topK.begin() + resultSize, topK.end(), MoreFrequent);
+            topK.resize(resultSize);
+            return topK;
+        }
+
+        // Writes "count<TAB>line" for each counted line
+        void WriteCountedStrings(
+            const std::vector<std::vector<CountedLine>> &countedStrings,
+            u32 threadNum,
+            bool ordered = false
+        ) {
+            // The longest u64 has 20 digits
+            constexpr u32 MAX_COUNT_DIGITS = 20;
+            std::mutex stdoutMutex;
+
+            omp_set_num_threads(threadNum);
+            #pragma omp parallel
+            {
+                int threadId = omp_get_thread_num();
+                u64 bufBytes = 0;
+                for (auto &str: countedStrings[threadId]) {
+                    bufBytes += MAX_COUNT_DIGITS + 1 + str.len + 1;
+                }
+
+                char* threadBuf = (char*)malloc(bufBytes + 1);
+                u64 currentBufBytes = 0;
+                for (auto &str: countedStrings[threadId]) {
+                    char digits[MAX_COUNT_DIGITS];
+                    u32 digitNum = 0;
+                    for (u64 count = str.count; count > 0; count /= 10) {
+                        digits[MAX_COUNT_DIGITS - ++digitNum] = '0' + count % 10;
+                    }
+                    memcpy(threadBuf + currentBufBytes, digits + MAX_COUNT_DIGITS - digitNum, digitNum);
+                    currentBufBytes += digitNum;
+                    threadBuf[currentBufBytes++] = '\t';
+                    memcpy(threadBuf + currentBufBytes, str.ptr, str.len);
+                    threadBuf[currentBufBytes + str.len] = '\n';
+                    currentBufBytes += str.len + 1;
+                }
+
+                if (ordered) {
+                    #pragma omp for ordered schedule(static, 1)
+                    for (u32 t = 0; t < threadNum; t++) {
+                        #pragma omp ordered
+                        WriteAll(STDOUT_FILENO, threadBuf, currentBufBytes);
+                    }
+                } else {
+                    std::unique_lock<std::mutex> lock(stdoutMutex);
+                    WriteAll(STDOUT_FILENO, threadBuf, currentBufBytes);
+                }
+                free(threadBuf);
+            }
+        }
+
+        constexpr u32 SAMPLE_RUNS = 4096;
+        constexpr u32 SAMPLE_RUN_LINES = 4;
+        constexpr u64 PARTITIONED_THRESHOLD = 1 << 20;
+        // Engine::Partitioned keeps a record of at least 16 bytes per line until pass two,
+        // where a shared table takes at most 32 bytes per unique string while it grows.
+        // With more lines per unique string than this, the records take over twice as much.
+        constexpr u64 PARTITIONED_MAX_LINES_PER_UNIQUE = 4;
+        constexpr u64 PARTITIONED_RECORD_SIZE = sizeof(LineRecord<u64>);
+
+        struct InputEstimate {
+            u64 lineCount;
+            u64 uniqueCount;
+        };
+
+        // Assuming uniformly drawn strings, a sample of s lines containing d distinct strings
+        // out of lineCount lines satisfies d = U * (1 - exp(-s / U)), which is solved for
+        // the number of unique strings U by bisection
+        u64 SolveUniqueCount(double s, double d, double lineCount) {
+            if (d >= s) return lineCount;
+
+            double lo = d, hi = std::max(lineCount, d);
+            for (u32 i = 0; i < 64; i++) {
+                double mid = (lo + hi) / 2;
+                if (mid * (1 - exp(-s / mid)) < d) {
+                    lo = mid;
+                } else {
+                    hi = mid;
+                }
+            }
+            return hi;
+        }
+
+        // Estimate the numbers of lines and unique strings from short runs of lines at
+        // random positions
+        InputEstimate EstimateUniqueCount(const char* beg, const char* end) {
+            u64 fileSize = end - beg;
+            HashTable<> sample;
+            u64 sampledLines = 0;
+            u64 sampledBytes = 0;
+
+            std::vector<u64> positions(SAMPLE_RUNS);
+            u64 state = 0x9e3779b97f4a7c15;
+            for (auto &pos: positions) {
+                state ^= state << 13;
+                state ^= state >> 7;
+                state ^= state << 17;
+                pos = state % fileSize;
+            }
+            std::sort(positions.begin(), positions.end());
+
+            // Runs never overlap, otherwise the same line would be counted as a duplicate
+            const char* prevEnd = beg;
+            for (u64 pos: positions) {
+                const char* currentPtr = beg + pos;
+                if (currentPtr < prevEnd) {
+                    currentPtr = prevEnd;
+                } else if (currentPtr != beg) {
+                    currentPtr = ClosestNewline(currentPtr - 1, end) + 1;
+                }
+
+                for (u32 i = 0; i < SAMPLE_RUN_LINES && currentPtr < end; i++) {
+                    u64 hash;
+                    u32 len;
+                    Hash(currentPtr, hash, len);
+                    sample.Insert(hash);
+                    sampledLines++;
+                    sampledBytes += len + 1;
+                    currentPtr += len + 1;
+                }
+                prevEnd = std::max(prevEnd, currentPtr);
+            }
+
+            if (sampledLines == 0) return {0, 0};
+
+            double lineCount = (double)fileSize * sampledLines / sampledBytes;
+            return {(u64)lineCount, SolveUniqueCount(sampledLines, sample.Size(), lineCount)};
+        }
+
+        constexpr u32 HLL_PRECISION = 14;
+        // The standard error of an estimate is about 1.04 / sqrt(2^precision)
+        constexpr u32 HLL_MIN_PRECISION = 4;
+        constexpr u32 HLL_MAX_PRECISION = 18;
+
+        // HyperLogLog sketch of 64-bit hashes with 2^precision one-byte registers. The top
+        // precision bits of a hash select a register, which keeps the highest rank (number
+        // of leading zeros plus one) seen in the remaining bits.
+        class HyperLogLog {
+            u32 precision;
+            std::vector<uint8_t> registers;
+        public:
+            explicit HyperLogLog(u32 precision = HLL_PRECISION)
+                : precision(precision), registers(1ULL << precision) {}
+
+            inline void Add(u64 hash) {
+                u64 idx = hash >> (64 - precision);
+                uint8_t rank = __builtin_clzll((hash << precision) | (1ULL << (precision - 1))) + 1;
+                if (rank > registers[idx]) registers[idx] = rank;
+            }
+
+            void Merge(const HyperLogLog &other) {
+                for (u64 i = 0; i < registers.size(); i++) {
+                    registers[i] = std::max(registers[i], other.registers[i]);
+                }
+            }
+
+            double Estimate() const {
+                double m = registers.size();
+                double sum = 0;
+                u64 zeros = 0;
+                for (uint8_t rank: registers) {
+                    sum += ldexp(1.0, -rank);
+                    zeros += rank == 0;
+                }
+                double alpha = m == 16 ? 0.673 : m == 32 ? 0.697 : m == 64 ? 0.709 : 0.7213 / (1 + 1.079 / m);
+                double estimate = alpha * m * m / sum;
+                // Linear counting is more accurate while many registers are empty
+                if (estimate <= 2.5 * m && zeros > 0) {
+                    estimate = m * log(m / zeros);
+                }
+                return estimate;
+            }
+        };
+
+        // The presizing pass samples a run of about PRESIZE_RUN_BYTES every
+        // PRESIZE_RUN_SPACING bytes, 1/32 of the input
+        constexpr u64 PRESIZE_RUN_SPACING = 16 << 10;
+        constexpr u64 PRESIZE_RUN_BYTES = 512;
+        // Room for the estimation error and for buckets getting more than their share
+        constexpr double PRESIZE_SLACK = 1.25;
+
+        // Estimate the number of unique strings from runs of lines spread evenly over the
+        // work units. The distinct strings of the sample are counted with a HyperLogLog
+        // sketch per thread, so a sample of millions of lines takes kilobytes.
+        u64 EstimateDistinct(const std::vector<std::pair<const char*, u64>> &units, u32 threadNum) {
+            HyperLogLog sketch;
+            u64 sampledLines = 0;
+            u64 sampledBytes = 0;
+            u64 inputBytes = 0;
+
+            omp_set_num_threads(threadNum);
+            #pragma omp parallel reduction(+:sampledLines, sampledBytes, inputBytes)
+            {
+                HyperLogLog threadSketch;
+                #pragma omp for schedule(dynamic)
+                for (u64 i = 0; i < units.size(); i++) {
+                    const char* beg = units[i].first;
+                    const char* end = beg + units[i].second;
+                    inputBytes += units[i].second;
+                    const char* run = beg;
+                    while (run < end) {
+                        const char* currentPtr = (run == beg) ? beg : ClosestNewline(run - 1, end) + 1;
+                        const char* runEnd = std::min(currentPtr + PRESIZE_RUN_BYTES, end);
+                        while (currentPtr < runEnd) {
+                            u64 hash;
+                            u32 len;
+                            Hash(currentPtr, hash, len);
+                            threadSketch.Add(hash);
+                            sampledLines++;
+                            sampledBytes += len + 1;
+                            currentPtr += len + 1;
+                        }
+                        // Lines longer than the spacing are never searched twice
+                        run = std::max(run + PRESIZE_RUN_SPACING, currentPtr);
+                    }
+                }
+                #pragma omp critical
+                sketch.Merge(threadSketch);
+            }
+
+            if (sampledLines == 0) return 0;
+
+            double lineCount = (double)inputBytes * sampledLines / sampledBytes;
+            return SolveUniqueCount(sampledLines, std::min(sketch.Estimate(), (double)sampledLines), lineCount);
+        }
+
+        // Adds the hashes of all lines of the chunk to the sketch. Only the 64-bit hashes
+        // are computed, and the sketch stays in the L1 or L2 cache, so this runs at the
+        // speed of the hash kernel.
+        void SketchChunk(HyperLogLog &sketch, const char* inputChunk, u64 chunkLen) {
+            const char* currentPtr = inputChunk;
+            u64 hashBuffer[BATCHSIZE];
+            u32 lenBuffer[BATCHSIZE];
+
+            while (currentPtr < inputChunk + chunkLen) {
+                u32 bufLen = HashLines(currentPtr, inputChunk + chunkLen, hashBuffer, lenBuffer, BATCHSIZE);
+                for (u32 i = 0; i < bufLen; i++) {
+                    sketch.Add(hashBuffer[i]);
+                    currentPtr += lenBuffer[i] + 1;
+                }
+            }
+        }
+
+        // Each thread sketches its chunk, and the sketches are merged at the end
+        HyperLogLog RunSketch(
+            const std::vector<std::pair<const char*, u64>> &chunks, u32 threadNum, u32 precision
+        ) {
+            HyperLogLog sketch(precision);
+            omp_set_num_threads(threadNum);
+            #pragma omp parallel
+            {
+                int threadId = omp_get_thread_num();
+                HyperLogLog threadSketch(precision);
+                SketchChunk(threadSketch, chunks[threadId].first, chunks[threadId].second);
+                #pragma omp critical
+                sketch.Merge(threadSketch);
+            }
+            return sketch;
+        }
+
+        // Engine::Auto picks Engine::Partitioned when the unique strings are too many for
+        // a shared table to stay in the caches, unless its records would cost much more
+        // memory than the table: on inputs with many duplicates, or when the records would
+        // take more than half of the physical memory.
+        Engine ResolveEngine(Engine engine, const char* beg, const char* end) {
+            if (engine != Engine::Auto) return engine;
+            InputEstimate estimate = EstimateUniqueCount(beg, end);
+            u64 physicalMemory = (u64)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+            bool partitioned = estimate.uniqueCount >= PARTITIONED_THRESHOLD
+                && estimate.lineCount <= PARTITIONED_MAX_LINES_PER_UNIQUE * estimate.uniqueCount
+                && estimate.lineCount * PARTITIONED_RECORD_SIZE <= physicalMemory / 2;
+            return partitioned ? Engine::Partitioned : Engine::BucketMutex;
+        }
+
+        constexpr u64 STREAM_BLOCK_SIZE = 8 << 20;
+        constexpr u32 STREAM_BLOCKS_PER_THREAD = 2;
+        // Bytes allocated past the capacity of a block. The kernels may load up to 64 bytes
+        // at a time past the last newline, as INPUT_PADDING, and the newline ending the last
+        // line of the stream may itself take the first of them.
+        constexpr u64 STREAM_BLOCK_PADDING = 64;
+        constexpr u32 END_OF_STREAM = 0xffffffff;
+
+        struct StreamBlock {
+            char* data;
+            u64 len;
+            u64 capacity;
+            u64 seq;    // Position of the block in the input
+        };
+
+        class BlockQueue {
+            std::deque<u32> queue;
+            std::mutex mtx;
+            std::condition_variable cv;
+        public:
+            void Push(u32 blockIdx) {
+                {
+                    std::unique_lock<std::mutex> lock(mtx);
+                    queue.push_back(blockIdx);
+                }
+                cv.notify_one();
+            }
+
+            u32 Pop() {
+                std::unique_lock<std::mutex> lock(mtx);
+                cv.wait(lock, [&] { return !queue.empty(); });
+                u32 blockIdx = queue.front();
+                queue.pop_front();
+                return blockIdx;
+            }
+        };
+
+        // Read until buf is full or the end of the input is reached
+        u64 ReadFull(int fd, char* buf, u64 len) {
+            u64 filled = 0;
+            while (filled < len) {
+                ssize_t readBytes = read(fd, buf + filled, len - filled);
+                if (readBytes == -1) {
+                    if (errno == EINTR) continue;
+                    perror("read");
+                    exit(1);
+                }
+                if (readBytes == 0) break;
+                filled += readBytes;
+            }
+            return filled;
+        }
+
+        // Fill free blocks with whole lines from fd and hand them to the workers.
+        // The trailing partial line of a block is carried over to the next one.
+        void ReadBlocks(
+            int fd,
+            std::vector<StreamBlock> &blocks,
+            BlockQueue &freeBlocks,
+            BlockQueue &fullBlocks,
+            u32 workerNum
+        ) {
+            std::vector<char> carry;
+            bool eof = false;
+            u64 seq = 0;
+
+            while (!eof) {
+                u32 blockIdx = freeBlocks.Pop();
+                StreamBlock &block = blocks[blockIdx];
+
+                // A line longer than a block makes the block grow
+                if (carry.size() >= block.capacity / 2) {
+                    free(block.data);
+                    block.capacity = 2 * carry.size();
+                    block.data = (char*)malloc(block.capacity + STREAM_BLOCK_PADDING);
+                }
+
+                memcpy(block.data, carry.data(), carry.size());
+                u64 filled = carry.size();
+                u64 readBytes = ReadFull(fd, block.data + filled, block.capacity - filled);
+                filled += readBytes;
+                eof = readBytes < block.capacity - carry.size();
+
+                const char* lastNewline = (const char*)memrchr(block.data, '\n', filled);
+                if (eof) {
+                    if (filled > 0 && block.data[filled - 1] != '\n') {
+                        block.data[filled++] = '\n';
+                    }
+                    block.len = filled;
+                    carry.clear();
+                } else if (lastNewline == NULL) {
+                    block.len = 0;
+                    carry.assign(block.data, block.data + filled);
+                } else {
+                    block.len = lastNewline + 1 - block.data;
+                    carry.assign(block.data + block.len, block.data + filled);
+                }
+
+                if (block.len > 0) {
+                    block.seq = seq++;
+                    fullBlocks.Push(blockIdx);
+                } else {
+                    freeBlocks.Push(blockIdx);
+                }
+            }
+
+            for (u32 i = 0; i < workerNum; i++) {
+                fullBlocks.Push(END_OF_STREAM);
+            }
+        }
+
+        // Thread 0 reads the input while the other threads deduplicate the blocks
+        // which have already been read.
+        template <typename Table>
+        void RunStream(Table &ht, int fd, u32 threadNum, const KeySpec* key = nullptr) {
+            std::vector<StreamBlock> blocks(STREAM_BLOCKS_PER_THREAD * threadNum);
+            BlockQueue freeBlocks, fullBlocks;
+            for (u32 i = 0; i < blocks.size(); i++) {
+                blocks[i].capacity = STREAM_BLOCK_SIZE;
+                blocks[i].data = (char*)malloc(STREAM_BLOCK_SIZE + STREAM_BLOCK_PADDING);
+                blocks[i].len = 0;
+                freeBlocks.Push(i);
+            }
+
+            std::mutex stdoutMutex;
+
+            omp_set_num_threads(threadNum + 1);
+            #pragma omp parallel
+            {
+                if (omp_get_thread_num() == 0) {
+                    ReadBlocks(fd, blocks, freeBlocks, fullBlocks, omp_get_num_threads() - 1);
+                } else {
+                    while (true) {
+                        u32 blockIdx = fullBlocks.Pop();
+                        if (blockIdx == END_OF_STREAM) break;
+                        ProcessChunk(ht, blocks[blockIdx].data, blocks[blockIdx].len, stdoutMutex, false, key);
+                        freeBlocks.Push(blockIdx);
+                    }
+                }
+            }
+
+            for (auto &block: blocks) {
+                free(block.data);
+            }
+        }
+
+        // Like RunStream, but the blocks are inserted into a single table in input order.
+        // The workers hash their blocks in parallel and then wait for their turn, so only
+        // the inserts are serialized.
+        template <typename Key>
+        u64 RunStreamOrdered(int fd, u32 threadNum, const KeySpec* key = nullptr) {
+            using Traits = KeyTraits<Key>;
+            std::vector<StreamBlock> blocks(STREAM_BLOCKS_PER_THREAD * threadNum);
+            BlockQueue freeBlocks, fullBlocks;
+            for (u32 i = 0; i < blocks.size(); i++) {
+                blocks[i].capacity = STREAM_BLOCK_SIZE;
+                blocks[i].data = (char*)malloc(STREAM_BLOCK_SIZE + STREAM_BLOCK_PADDING);
+                blocks[i].len = 0;
+                freeBlocks.Push(i);
+            }
+
+            HashTable<Key> table;
+            u64 nextSeq = 0;
+            std::mutex turnMutex;
+            std::condition_variable turnCv;
+
+            omp_set_num_threads(threadNum + 1);
+            #pragma omp parallel
+            {
+                if (omp_get_thread_num() == 0) {
+                    ReadBlocks(fd, blocks, freeBlocks, fullBlocks, omp_get_num_threads() - 1);
+                } else {
+                    std::vector<typename Traits::HashType> hashes;
+                    std::vector<u32> lens;
+                    OutputRuns output;
+                    while (true) {
+                        u32 blockIdx = fullBlocks.Pop();
+                        if (blockIdx == END_OF_STREAM) break;
+                        StreamBlock &block = blocks[blockIdx];
+
+                        u64 lineNum = 0;
+                        for (const char* currentPtr = block.data; currentPtr < block.data + block.len; ) {
+                            if (hashes.size() < lineNum + BATCHSIZE) {
+                                hashes.resize(lineNum + BATCHSIZE);
+                                lens.resize(lineNum + BATCHSIZE);
+                            }
+                            u32 bufLen = HashLines(currentPtr, block.data + block.len,
+                                hashes.data() + lineNum, lens.data() + lineNum, BATCHSIZE, key);
+                            for (u32 i = 0; i < bufLen; i++) {
+                                currentPtr += lens[lineNum + i] + 1;
+                            }
+                            lineNum += bufLen;
+                        }
+
+                        std::unique_lock<std::mutex> lock(turnMutex);
+                        turnCv.wait(lock, [&] { return nextSeq == block.seq; });
+                        lock.unlock();
+
+                        const char* currentPtr = block.data;
+                        for (u64 i = 0; i < lineNum; i++) {
+                            if (i + PREFETCH_STRIDE < lineNum) {
+                                table.Prefetch(Traits::Make(hashes[i + PREFETCH_STRIDE], currentPtr, 0));
+                            }
+                            if (table.Insert(Traits::Make(hashes[i], currentPtr, lens[i]))) {
+                                output.Add(currentPtr, lens[i]);
+                            }
+                            currentPtr += lens[i] + 1;
+                        }
+                        output.Write(STDOUT_FILENO);
+
+                        lock.lock();
+                        nextSeq++;
+                        lock.unlock();
+                        turnCv.notify_all();
+                        freeBlocks.Push(blockIdx);
+                    }
+                }
+            }
+
+            for (auto &block: blocks) {
+                free(block.data);
+            }
+
+            return table.Size();
+        }
+
+        template <typename HashWidth>
+        struct HashWidthKey {
+            using type = u64;
+        };
+
+        template <>
+        struct HashWidthKey<Hash128> {
+            using type = WideHash;
+        };
+
+        template <typename Key>
+        std::vector<std::vector<std::pair<const char*, u32>>> UniquifyChunksVec(
+            const char* input,
+            const char* end,
+            const std::vector<std::pair<const char*, u64>> &chunks,
+            u32 threadNum,
+            Engine engine,
+            const Options &options,
+            bool numa
+        ) {
+            bool ordered = options.ordered;
+            bool hugePages = options.hugePages;
+            KeySpec keySpec(options);
+            const KeySpec* key = keySpec.Keyed() ? &keySpec : nullptr;
+            if (engine == Engine::Partitioned || ordered) {
+                if (numa) PlaceInput(chunks, threadNum);
+                return RunPartitioned<Key>(chunks, threadNum, ordered, options.memoryLimit, numa, hugePages, key);
+            }
+
+            auto units = SplitWork(input, end, threadNum);
+            if (numa) PlaceInput(units, threadNum);
+            if (engine == Engine::LockFree && std::is_same_v<Key, u64>) {
+                LockFreeHashTable ht(threadNum, hugePages);
+                if (options.presize) ht.Reserve(EstimateDistinct(units, threadNum) * PRESIZE_SLACK);
+                return RunChunksVec(ht, units, threadNum, numa, key);
+            } else {
+                ParallelHashTable<Key> ht(threadNum);
+                if (numa) ht.PlaceBuckets();
+                if (hugePages) ht.UseHugePages();
+                if (options.presize) ht.Reserve(EstimateDistinct(units, threadNum) * PRESIZE_SLACK);
+                return RunChunksVec(ht, units, threadNum, numa, key);
+            }
+        }
+
+        // The engines with a table shared by all threads, which take work units from any
+        // number of inputs
+        template <typename Key>
+        u64 UniquifyUnitsToStdout(
+            const std::vector<std::pair<const char*, u64>> &units,
+            u32 threadNum,
+            Engine engine,
+            const Options &options,
+            bool numa,
+            const KeySpec* key
+        ) {
+            bool hugePages = options.hugePages;
+            if (numa) PlaceInput(units, threadNum);
+            if (engine == Engine::LockFree && std::is_same_v<Key, u64>) {
+                LockFreeHashTable ht(threadNum, hugePages);
+                if (options.presize) ht.Reserve(EstimateDistinct(units, threadNum) * PRESIZE_SLACK);
+                RunChunks(ht, units, threadNum, numa, key);
+                return ht.Size();
+            } else {
+                ParallelHashTable<Key> ht(threadNum);
+                if (numa) ht.PlaceBuckets();
+                if (hugePages) ht.UseHugePages();
+                if (options.presize) ht.Reserve(EstimateDistinct(units, threadNum) * PRESIZE_SLACK);
+                RunChunks(ht, units, threadNum, numa, key);
+                return ht.Size();
+            }
+        }
+
+        template <typename Key>
+        u64 UniquifyChunksToStdout(
+            const char* input,
+            const char* end,
+            const std::vector<std::pair<const char*, u64>> &chunks,
+            u32 threadNum,
+            Engine engine,
+            const Options &options,
+            bool numa
+        ) {
+            bool ordered = options.ordered;
+            KeySpec keySpec(options);
+            const KeySpec* key = keySpec.Keyed() ? &keySpec : nullptr;
+            if (engine == Engine::Partitioned || ordered) {
+                if (numa) PlaceInput(chunks, threadNum);
+                auto results = RunPartitioned<Key>(chunks, threadNum, ordered, options.memoryLimit, numa, options.hugePages, key);
+                WriteUniqueStrings(results, threadNum, ordered);
+                u64 uniqueCount = 0;
+                for (auto &result: results) {
+                    uniqueCount += result.size();
+                }
+                return uniqueCount;
+            }
+
+            return UniquifyUnitsToStdout<Key>(SplitWork(input, end, threadNum), threadNum, engine, options, numa, key);
+        }
+
+        // Same as UniquifyChunksToStdout without writing the unique lines. The partitioned
+        // engine still collects them per thread, but only to count them.
+        template <typename Key>
+        u64 CountChunks(
+            const char* input,
+            const char* end,
+            const std::vector<std::pair<const char*, u64>> &chunks,
+            u32 threadNum,
+            Engine engine,
+            const Options &options,
+            bool numa
+        ) {
+            bool hugePages = options.hugePages;
+            KeySpec keySpec(options);
+            const KeySpec* key = keySpec.Keyed() ? &keySpec : nullptr;
+            if (engine == Engine::Partitioned) {
+                if (numa) PlaceInput(chunks, threadNum);
+                auto results = RunPartitioned<Key>(chunks, threadNum, false, options.memoryLimit, numa, hugePages, key);
+                u64 uniqueCount = 0;
+                for (auto &result: results) {
+                    uniqueCount += result.size();
+                }
+                return uniqueCount;
+            }
+
+            auto units = SplitWork(input, end, threadNum);
+            if (numa) PlaceInput(units, threadNum);
+            if (engine == Engine::LockFree && std::is_same_v<Key, u64>) {
+                LockFreeHashTable ht(threadNum, hugePages);
+                if (options.presize) ht.Reserve(EstimateDistinct(units, threadNum) * PRESIZE_SLACK);
+                RunChunksInsert(ht, units, threadNum, numa, key);
+                return ht.Size();
+            } else {
+                ParallelHashTable<Key> ht(threadNum);
+                if (numa) ht.PlaceBuckets();
+                if (hugePages) ht.UseHugePages();
+                if (options.presize) ht.Reserve(EstimateDistinct(units, threadNum) * PRESIZE_SLACK);
+                RunChunksInsert(ht, units, threadNum, numa, key);
+                return ht.Size();
+            }
+        }
+
+        // A seen-set file holds the buckets of a ParallelHashTable of hashes, so that it can
+        // be mapped and used again without rehashing:
+        //   SeenSetHeader
+        //   SeenSetBucket[bucketNum]
+        //   slots of bucket 0, bucket 1, ..., each starting at a multiple of SEEN_SET_ALIGN
+        // The hashes do not depend on the kernel, so the file can be used on any CPU of
+        // the same byte order.
+        constexpr char SEEN_SET_MAGIC[8] = {'F', 'U', 'S', 'E', 'E', 'N', 'S', 'T'};
+        constexpr u32 SEEN_SET_VERSION = 1;
+        constexpr u64 SEEN_SET_ALIGN = 64;
+
+        struct SeenSetHeader {
+            char magic[8];
+            u32 version;
+            u32 keyBytes;       // 8 with Hash64, 16 with Hash128
+            u32 bucketNum;
+            u32 reserved;
+            u64 uniqueCount;
+        };
+
+        struct SeenSetBucket {
+            u64 offset;         // From the beginning of the file
+            u64 capacity;
+            u64 size;
+        };
+
+        inline u64 AlignUp(u64 value, u64 align) {
+            return (value + align - 1) / align * align;
+        }
+
+        // A table loaded from a seen-set file. The slots are mapped privately, so inserts
+        // change only this process's copy until Save is called.
+        template <typename Key>
+        class SeenSet {
+            void* mapping = nullptr;
+            u64 mappingSize = 0;
+
+            // Maps path and returns its number of buckets, or 0 when path does not exist
+            u32 Load(const char* path) {
+                int fd = open(path, O_RDONLY);
+                if (fd == -1) {
+                    if (errno == ENOENT) return 0;
+                    perror("open");
+                    exit(1);
+                }
+                struct stat fileStat;
+                fstat(fd, &fileStat);
+                mappingSize = fileStat.st_size;
+
+                SeenSetHeader header = {};
+                if (mappingSize >= sizeof(header)) {
+                    PreadAll(fd, (char*)&header, sizeof(header), 0);
+                }
+                if (mappingSize < sizeof(header) || memcmp(header.magic, SEEN_SET_MAGIC, sizeof(SEEN_SET_MAGIC)) != 0
+                    || header.version != SEEN_SET_VERSION || header.keyBytes != sizeof(Key) || header.bucketNum == 0
+                    || mappingSize < sizeof(header) + header.bucketNum * sizeof(SeenSetBucket)) {
+                    fprintf(stderr, "%s: not a seen-set file of version %u with %lu-byte hashes\n", path, SEEN_SET_VERSION, sizeof(Key));
+                    exit(1);
+                }
+
+                mapping = mmap(nullptr, mappingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+                if (mapping == MAP_FAILED) {
+                    perror("mmap");
+                    exit(1);
+                }
+                close(fd);
+
+                // The slots of the buckets must lie in the file, one after the other. Only the
+                // bucket array is checked, so that loading does not read the slots.
+                const SeenSetBucket* buckets = (const SeenSetBucket*)((char*)mapping + sizeof(SeenSetHeader));
+                u64 slotsBeg = sizeof(header) + header.bucketNum * sizeof(SeenSetBucket);
+                u64 uniqueCount = 0;
+                for (u32 i = 0; i < header.bucketNum; i++) {
+                    const SeenSetBucket &bucket = buckets[i];
+                    if (bucket.offset % SEEN_SET_ALIGN != 0 || bucket.offset < slotsBeg || bucket.offset > mappingSize
+                        || bucket.capacity > (mappingSize - bucket.offset) / sizeof(Key)) {
+                        fprintf(stderr, "%s: truncated seen-set file\n", path);
+                        exit(1);
+                    }
+                    if (bucket.capacity == 0 || bucket.size >= bucket.capacity) {
+                        fprintf(stderr, "%s: corrupt seen-set file\n", path);
+                        exit(1);
+                    }
+                    slotsBeg = bucket.offset + bucket.capacity * sizeof(Key);
+                    uniqueCount += bucket.size;
+                }
+                if (uniqueCount != header.uniqueCount) {
+                    fprintf(stderr, "%s: corrupt seen-set file\n", path);
+                    exit(1);
+                }
+                return header.bucketNum;
+            }
+
+        public:
+            ParallelHashTable<Key> table;
+
+            // An empty set is used when path does not exist
+            SeenSet(const char* path, u32 threadNum) : table(threadNum, Load(path)) {
+                if (mapping == nullptr) return;
+                const SeenSetBucket* buckets = (const SeenSetBucket*)((char*)mapping + sizeof(SeenSetHeader));
+                for (u32 i = 0; i < table.BucketNum(); i++) {
+                    Key* slots = (Key*)((char*)mapping + buckets[i].offset);
+                    table.BucketTable(i).Adopt(slots, buckets[i].capacity, buckets[i].size);
+                }
+            }
+
+            SeenSet(const SeenSet&) = delete;
+            SeenSet& operator=(const SeenSet&) = delete;
+
+            // The tables never free slots they do not own, so they can outlive the mapping
+            ~SeenSet() {
+                if (mapping != nullptr) munmap(mapping, mappingSize);
+            }
+
+            // Writes the set to a temporary file next to path and renames it over path,
+            // so a reader never sees a partial file
+            void Save(const char* path) {
+                std::string tmpPath = std::string(path) + ".XXXXXX";
+                int fd = mkstemp(tmpPath.data());
+                if (fd == -1) {
+                    perror("mkstemp");
+                    exit(1);
+                }
+
+                SeenSetHeader header = {};
+                memcpy(header.magic, SEEN_SET_MAGIC, sizeof(SEEN_SET_MAGIC));
+                header.version = SEEN_SET_VERSION;
+                header.keyBytes = sizeof(Key);
+                header.bucketNum = table.BucketNum();
+                header.uniqueCount = table.Size();
+
+                std::vector<SeenSetBucket> buckets(header.bucketNum);
+                u64 offset = AlignUp(sizeof(header) + buckets.size() * sizeof(SeenSetBucket), SEEN_SET_ALIGN);
+                for (u32 i = 0; i < header.bucketNum; i++) {
+                    HashTable<Key> &bucketTable = table.BucketTable(i);
+                    bucketTable.FinishGrowth();
+                    buckets[i] = {offset, bucketTable.Capacity(), bucketTable.Size()};
+                    offset = AlignUp(offset + bucketTable.Capacity() * sizeof(Key), SEEN_SET_ALIGN);
+                }
+
+                WriteAll(fd, (const char*)&header, sizeof(header));
+                WriteAll(fd, (const char*)buckets.data(), buckets.size() * sizeof(SeenSetBucket));
+                u64 written = sizeof(header) + buckets.size() * sizeof(SeenSetBucket);
+                const char padding[SEEN_SET_ALIGN] = {};
+                for (u32 i = 0; i < header.bucketNum; i++) {
+                    WriteAll(fd, padding, buckets[i].offset - written);
+                    u64 bytes = buckets[i].capacity * sizeof(Key);
+                    WriteAll(fd, (const char*)table.BucketTable(i).Slots(), bytes);
+                    written = buckets[i].offset + bytes;
+                }
+
+                // mkstemp creates the file for the owner only. Keep the mode of the old set
+                struct stat oldStat;
+                fchmod(fd, stat(path, &oldStat) == 0 ? oldStat.st_mode & 07777 : 0644);
+                if (fsync(fd) == -1) {
+                    perror("fsync");
+                    exit(1);
+                }
+                close(fd);
+                if (rename(tmpPath.data(), path) == -1) {
+                    perror("rename");
+                    exit(1);
+                }
+            }
+        };
+    } // namespace Internal
+
+    // Unique strings returned by Uniquify. The strings are views into the mapping of the
+    // input file, which is owned by the result and unmapped when it is destroyed, so no
+    // string is allocated or copied.
+    class UniqueResult {
+        const char* mapping = nullptr;
+        u64 mappingSize = 0;
+        std::vector<std::string_view> entries;
+
+        void Release() {
+            if (mapping != nullptr) {
+                Internal::UnmapInput(mapping, mappingSize);
+            }
+            mapping = nullptr;
+            mappingSize = 0;
+            entries.clear();
+        }
+    public:
+        UniqueResult() = default;
+
+        UniqueResult(const char* mapping, u64 mappingSize, std::vector<std::string_view> &&entries)
+            : mapping(mapping), mappingSize(mappingSize), entries(std::move(entries)) {}
+
+        UniqueResult(const UniqueResult&) = delete;
+        UniqueResult& operator=(const UniqueResult&) = delete;
+
+        UniqueResult(UniqueResult &&other) noexcept
+            : mapping(other.mapping), mappingSize(other.mappingSize), entries(std::move(other.entries)) {
+            other.mapping = nullptr;
+            other.mappingSize = 0;
+        }
+
+        UniqueResult& operator=(UniqueResult &&other) noexcept {
+            if (this != &other) {
+                Release();
+                std::swap(mapping, other.mapping);
+                std::swap(mappingSize, other.mappingSize);
+                entries.swap(other.entries);
+            }
+            return *this;
+        }
+
+        ~UniqueResult() {
+            Release();
+        }
+
+        u64 size() const { return entries.size(); }
+        bool empty() const { return entries.empty(); }
+        std::string_view operator[](u64 i) const { return entries[i]; }
+        std::vector<std::string_view>::const_iterator begin() const { return entries.begin(); }
+        std::vector<std::string_view>::const_iterator end() const { return entries.end(); }
+
+        // Copies the strings for callers which need to own them
+        operator std::vector<std::string>() const {
+            return std::vector<std::string>(entries.begin(), entries.end());
+        }
+    };
+
+    // Dedupliate newline separated strings in the input file
+    // and return them as views into the input, which the result keeps mapped.
+    template <typename HashWidth = Hash64>
+    UniqueResult Uniquify(
+        const char *inputFile, u32 threadNum = 1, const Options &options = Options()
+    ) {
+        // TODO : error handling
+        int fd = open(inputFile, O_RDONLY);
+        if (fd == -1) {
+            perror("open");
+            exit(1);
+        }
+        struct stat fileStat;
+        fstat(fd, &fileStat);
+        u64 fileSize = fileStat.st_size;
+
+        if (fileSize == 0) {
+            close(fd);
+            return {};
+        }
+
+        // With NUMA, the pages are faulted in by the threads that start on them instead
+        bool numa = Internal::NumaActive(options.numa);
+        const char* input = Internal::MapInput(fd, fileSize, numa, options.hugePages);
+        if (input == MAP_FAILED) {
+            perror("mmap");
+            close(fd);
+            exit(1);
+        }
+
+        auto chunks = Internal::DivideInput(input, input + fileSize, threadNum);
+
+        std::vector<std::vector<std::pair<const char*, u32>>> results;
+        Engine engine = (options.ordered || options.memoryLimit > 0)
+            ? Engine::Partitioned : Internal::ResolveEngine(options.engine, input, input + fileSize);
+        if (options.exact && !Internal::KeySpec(options).Keyed()) {
+            results = Internal::UniquifyChunksVec<Internal::LineKey>(input, input + fileSize, chunks, threadNum, engine, options, numa);
+        } else {
+            using Key = typename Internal::HashWidthKey<HashWidth>::type;
+            results = Internal::UniquifyChunksVec<Key>(input, input + fileSize, chunks, threadNum, engine, options, numa);
+        }
+
+        std::vector<u64> accum;
+        accum.push_back(0);
+        for (auto &result: results) {
+            accum.push_back(accum.back() + result.size());
+        }
+
+        std::vector<std::string_view> entries(accum.back());
+        omp_set_num_threads(threadNum);
+        #pragma omp parallel
+        {
+            int threadId = omp_get_thread_num();
+            auto dst = entries.begin() + accum[threadId];
+            for (auto &src: results[threadId]) {
+                *(dst++) = std::string_view(src.first, src.second);
+            }
+        }
+
+        // The mapping stays valid after the file is closed
+        close(fd);
+
+        return UniqueResult(input, fileSize, std::move(entries));
+    }
+
+    // Dedupliate newline separated strings in the input file
+    // and write deduplicated strings to stdout.
+    template <typename HashWidth = Hash64>
+    u64 UniquifyToStdout(
+        const char *inputFile, u32 threadNum = 1, const Options &options = Options()
+    ) {
+        // TODO : error handling
+        int fd = open(inputFile, O_RDONLY);
+        if (fd == -1) {
+            perror("open");
+            exit(1);
+        }
+        struct stat fileStat;
+        fstat(fd, &fileStat);
+        u64 fileSize = fileStat.st_size;
+
+        if (fileSize == 0) {
+            close(fd);
+            return 0;
+        }
+
+        // With NUMA, the pages are faulted in by the threads that start on them instead
+        bool numa = Internal::NumaActive(options.numa);
+        const char* input = Internal::MapInput(fd, fileSize, numa, options.hugePages);
+        if (input == MAP_FAILED) {
+            perror("mmap");
+            close(fd);
+            exit(1);
+        }
 
-            u32 Size() {
-                return size;
-            }
+        auto chunks = Internal::DivideInput(input, input + fileSize, threadNum);
 
-            inline void Prefetch(u64 hash) {
-                u32 i = CalcSlotIdx(hash);
-                __builtin_prefetch(data + i);
-            }
-        };
+        u64 uniqueCount;
+        Engine engine = (options.ordered || options.memoryLimit > 0)
+            ? Engine::Partitioned : Internal::ResolveEngine(options.engine, input, input + fileSize);
+        if (options.exact && !Internal::KeySpec(options).Keyed()) {
+            uniqueCount = Internal::UniquifyChunksToStdout<Internal::LineKey>(input, input + fileSize, chunks, threadNum, engine, options, numa);
+        } else {
+            using Key = typename Internal::HashWidthKey<HashWidth>::type;
+            uniqueCount = Internal::UniquifyChunksToStdout<Key>(input, input + fileSize, chunks, threadNum, engine, options, numa);
+        }
 
-        class ParallelHashTable {
-            struct Bucket {
-                std::shared_mutex mtx;
-                HashTable table;
+        Internal::UnmapInput(input, fileSize);
+        close(fd);
 
-                Bucket() : table() {} 
+        return uniqueCount;
+    }
 
-                Bucket(Bucket&& other) noexcept : table(std::move(other.table)) {}
-            };
-            std::vector<Bucket> buckets;
+    // Return the number of unique newline separated strings in the input file without
+    // writing them. The order makes no difference to a count, so options.ordered has no
+    // effect.
+    template <typename HashWidth = Hash64>
+    u64 CountDistinct(
+        const char *inputFile, u32 threadNum = 1, const Options &options = Options()
+    ) {
+        int fd = open(inputFile, O_RDONLY);
+        if (fd == -1) {
+            perror("open");
+            exit(1);
+        }
+        struct stat fileStat;
+        fstat(fd, &fileStat);
+        u64 fileSize = fileStat.st_size;
 
-            static constexpr u32 BUCKETS_THREADS_FACTOR = 64;
+        if (fileSize == 0) {
+            close(fd);
+            return 0;
+        }
 
-            inline u32 CalcBucketIdx(u64 hash) {
-                return (hash & ((1LL << 32) - 1)) % buckets.size();
-            }
-        public:
-            ParallelHashTable(u32 num_threads) {
-                buckets.resize(num_threads * BUCKETS_THREADS_FACTOR);
-            }
+        bool numa = Internal::NumaActive(options.numa);
+        const char* input = Internal::MapInput(fd, fileSize, numa, options.hugePages);
+        if (input == MAP_FAILED) {
+            perror("mmap");
+            close(fd);
+            exit(1);
+        }
 
-            bool Insert(u64 hash) {
-                u32 bucketIdx = CalcBucketIdx(hash);
-                Bucket &bucket = buckets[bucketIdx];
+        auto chunks = Internal::DivideInput(input, input + fileSize, threadNum);
 
-                std::shared_lock<std::shared_mutex> readLock(bucket.mtx);
-                if (bucket.table.Find(hash)) {
-                    return false;
-                }
-                readLock.unlock();
-                std::unique_lock<std::shared_mutex> writeLock(bucket.mtx);
-                return bucket.table.Insert(hash);
-            }
+        u64 uniqueCount;
+        Engine engine = (options.memoryLimit > 0)
+            ? Engine::Partitioned : Internal::ResolveEngine(options.engine, input, input + fileSize);
+        if (options.exact && !Internal::KeySpec(options).Keyed()) {
+            uniqueCount = Internal::CountChunks<Internal::LineKey>(input, input + fileSize, chunks, threadNum, engine, options, numa);
+        } else {
+            using Key = typename Internal::HashWidthKey<HashWidth>::type;
+            uniqueCount = Internal::CountChunks<Key>(input, input + fileSize, chunks, threadNum, engine, options, numa);
+        }
 
-            void ShowBucketsSize() {
-                for (auto &bucket: buckets) {
-                    std::cerr << bucket.table.Size() << "\n";
-                }
-            }
+        Internal::UnmapInput(input, fileSize);
+        close(fd);
 
-            inline void Prefetch(u64 hash) {
-                u32 bucketIdx = CalcBucketIdx(hash);
-                Bucket &bucket = buckets[bucketIdx];
-                bucket.table.Prefetch(hash);
-            }
+        return uniqueCount;
+    }
 
-            u32 Size() {
-                u32 ret = 0;
-                for (auto &bucket: buckets) {
-                    ret += bucket.table.Size();
-                }
-                return ret;
-            }
-        };
+    // Estimate the number of unique newline separated strings in the input file with a
+    // HyperLogLog sketch of 2^precision one-byte registers per thread, for a standard
+    // error of about 1.04 / sqrt(2^precision) (0.8% with the default precision).
+    // No table is built, so this takes kilobytes of memory whatever the input.
+    u64 CountDistinctApprox(
+        const char *inputFile, u32 threadNum = 1, u32 precision = Internal::HLL_PRECISION
+    ) {
+        if (precision < Internal::HLL_MIN_PRECISION || precision > Internal::HLL_MAX_PRECISION) {
+            fprintf(stderr, "CountDistinctApprox: precision must be between %u and %u\n",
+                Internal::HLL_MIN_PRECISION, Internal::HLL_MAX_PRECISION);
+            exit(1);
+        }
 
-        const u8x16 key = _mm_set_epi64x(884041218509897051, 464828032585196773);
-        const u8x16 chunkMask[17] = {
-            _mm_set_epi8(0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00),
-            _mm_set_epi8(0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff),
-            _mm_set_epi8(0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0xff),
-            _mm_set_epi8(0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff),
-            _mm_set_epi8(0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff),
-            _mm_set_epi8(0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff, 0xff),
-            _mm_set_epi8(0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff),
-            _mm_set_epi8(0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff),
-            _mm_set_epi8(0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff),
-            _mm_set_epi8(0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff),
-            _mm_set_epi8(0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff),
-            _mm_set_epi8(0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff),
-            _mm_set_epi8(0x00, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff),
-            _mm_set_epi8(0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff),
-            _mm_set_epi8(0x00, 0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff),
-            _mm_set_epi8(0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff),
-            _mm_set_epi8(0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff)
-        };
-        
+        int fd = open(inputFile, O_RDONLY);
+        if (fd == -1) {
+            perror("open");
+            exit(1);
+        }
+        struct stat fileStat;
+        fstat(fd, &fileStat);
+        u64 fileSize = fileStat.st_size;
 
-        void Hash(const char* input, u64 &hash, u32 &len) {
-            const char* currentPtr = input;
-            u8x32 newLines = _mm256_set1_epi8('\n');
-            while (true) {
-                const u8x32 chunk = _mm256_loadu_si256((u8x32*)currentPtr);
-                const u8x32 cmpResult = _mm256_cmpeq_epi8(chunk, newLines);
-                u32 mask = _mm256_movemask_epi8(cmpResult);
-                if (mask == 0) {
-                    currentPtr += 32;
-                } else { 
-                    currentPtr += __builtin_ctz(mask);
-                    break;
-                }
-            }
+        if (fileSize == 0) {
+            close(fd);
+            return 0;
+        }
 
-            len = currentPtr - input;
-            u32 tmpLen = len;
-            hash = 0;
-            for (; tmpLen > 0; tmpLen -= std::min(tmpLen, 16u), input += std::min(tmpLen, 16u)) {
-                u8x16 chunk = _mm_and_si128(_mm_loadu_si128((u8x16*)input), chunkMask[std::min(tmpLen, 16u)]);
-                chunk = _mm_aesenc_si128(chunk, key);
-                chunk = _mm_aesenc_si128(chunk, key);
-                hash ^= chunk[0] ^ chunk[1];
-            }
+        const char* input = Internal::MapInput(fd, fileSize, false, false);
+        if (input == MAP_FAILED) {
+            perror("mmap");
+            close(fd);
+            exit(1);
         }
 
-        std::vector<std::pair<const char*, u32>> ProcessChunkVec(
-            ParallelHashTable &ht,
-            const char* inputChunk,
-            u32 chunkLen
-        ) {
-            const char* currentPtr = inputChunk;
+        auto chunks = Internal::DivideInput(input, input + fileSize, threadNum);
+        double estimate = Internal::RunSketch(chunks, threadNum, precision).Estimate();
 
-            u64 hashBuffer[BATCHSIZE];
-            u32 lenBuffer[BATCHSIZE];
-            const char* ptrBuffer[BATCHSIZE];
+        Internal::UnmapInput(input, fileSize);
+        close(fd);
 
-            std::vector<std::pair<const char*, u32>> uniqueStrings;
+        return std::llround(estimate);
+    }
 
-            while (currentPtr - inputChunk < chunkLen) {
-                u32 uniqueCount = 0;
+    // Dedupliate newline separated strings across all the input files, as if they were
+    // concatenated, and write deduplicated strings to stdout. The files are split into
+    // work units of at most WORK_UNIT_MAX bytes which the threads take from each other
+    // as they become free, so the threads stay busy whatever the sizes of the files.
+    // All threads share one table, so Engine::Auto runs Engine::BucketMutex. The other
+    // options apply as in UniquifyToStdout, except Engine::Partitioned, options.ordered
+    // and options.memoryLimit, which need a single input and are rejected.
+    template <typename HashWidth = Hash64>
+    u64 UniquifyFilesToStdout(
+        const std::vector<std::string> &inputFiles, u32 threadNum = 1, const Options &options = Options()
+    ) {
+        if (options.engine == Engine::Partitioned || options.ordered || options.memoryLimit > 0) {
+            fprintf(stderr, "UniquifyFilesToStdout: Engine::Partitioned, options.ordered and options.memoryLimit are not available\n");
+            exit(1);
+        }
+        bool numa = Internal::NumaActive(options.numa);
+        auto mappings = Internal::MapFiles(inputFiles, numa, options.hugePages);
+        std::vector<std::pair<const char*, u64>> chunks;
+        for (auto &mapping: mappings) {
+            Internal::SplitInput(mapping.first, mapping.first + mapping.second, Internal::WORK_UNIT_MAX, chunks);
+        }
 
-                // Batchfy hashing & inserting
-                u32 i;
-                for (i = 0; i < BATCHSIZE && currentPtr - inputChunk < chunkLen; i++) {
-                    Hash(currentPtr, hashBuffer[i], lenBuffer[i]);
-                    ptrBuffer[i] = currentPtr;
-                    currentPtr += lenBuffer[i] + 1;
-                }
+        Internal::KeySpec keySpec(options);
+        const Internal::KeySpec* key = keySpec.Keyed() ? &keySpec : nullptr;
 
-                u32 bufLen = i;
-                for (i = 0; i < bufLen; i++) {
-                    if (i + PREFETCH_STRIDE < bufLen) ht.Prefetch(hashBuffer[i + PREFETCH_STRIDE]);
-                    if (ht.Insert(hashBuffer[i])) {
-                        uniqueCount++;
-                    }
-                }
+        u64 uniqueCount;
+        using Key = typename Internal::HashWidthKey<HashWidth>::type;
+        Engine engine = options.engine == Engine::Auto ? Engine::BucketMutex : options.engine;
+        if (options.exact && key == nullptr) {
+            uniqueCount = Internal::UniquifyUnitsToStdout<Internal::LineKey>(chunks, threadNum, engine, options, numa, key);
+        } else {
+            uniqueCount = Internal::UniquifyUnitsToStdout<Key>(chunks, threadNum, engine, options, numa, key);
+        }
 
-                for (i = 0; i < uniqueCount; i++) {
-                    uniqueStrings.emplace_back(ptrBuffer[i], lenBuffer[i]);
-                }
-            }
+        for (auto &mapping: mappings) {
+            Internal::UnmapInput(mapping.first, mapping.second);
+        }
 
-            return uniqueStrings;
+        return uniqueCount;
+    }
+
+    // Same as UniquifyFilesToStdout for the files matching a glob(7) pattern such as
+    // "logs/*.txt", in the order glob sorts them
+    template <typename HashWidth = Hash64>
+    u64 UniquifyGlobToStdout(
+        const char *pattern, u32 threadNum = 1, const Options &options = Options()
+    ) {
+        glob_t globResult;
+        int ret = glob(pattern, 0, nullptr, &globResult);
+        if (ret != 0 && ret != GLOB_NOMATCH) {
+            fprintf(stderr, "glob: cannot expand %s\n", pattern);
+            exit(1);
         }
+        std::vector<std::string> inputFiles(globResult.gl_pathv, globResult.gl_pathv + globResult.gl_pathc);
+        globfree(&globResult);
 
-        void ProcessChunk(
-            ParallelHashTable &ht, 
-            const char* inputChunk, 
-            u32 chunkLen, 
-            std::mutex &stdoutMutex
-        ) {
-            const char* currentPtr = inputChunk;
+        return UniquifyFilesToStdout<HashWidth>(inputFiles, threadNum, options);
+    }
 
-            u64 hashBuffer[BATCHSIZE];
-            u32 lenBuffer[BATCHSIZE];
-            const char* ptrBuffer[BATCHSIZE];
+    // Write the newline separated strings of the input file which are not in the seen set
+    // stored in seenSetFile to stdout, each once, and return their number. A missing
+    // seenSetFile is an empty set. When append is set, the new strings are added to the
+    // set and it is written back to seenSetFile, which is created if needed.
+    // Only hashes are stored, so this always runs Engine::BucketMutex without the exact
+    // mode, and a set must be used with the hash width and the keys (options.keyFields or
+    // options.jsonKeys) it was created with. options.ordered has no effect.
+    template <typename HashWidth = Hash64>
+    u64 UniquifyAgainst(
+        const char *seenSetFile, const char *inputFile, u32 threadNum = 1, bool append = false,
+        const Options &options = Options()
+    ) {
+        if (options.exact) {
+            fprintf(stderr, "UniquifyAgainst: the seen set only holds hashes, options.exact is not available\n");
+            exit(1);
+        }
+        Internal::KeySpec keySpec(options);
+        const Internal::KeySpec* key = keySpec.Keyed() ? &keySpec : nullptr;
 
-            char* threadBuf = (char*)malloc(1024);
-            u32 bufCapacity = 1024;
-            u32 currentBufBytes = 0;
+        int fd = open(inputFile, O_RDONLY);
+        if (fd == -1) {
+            perror("open");
+            exit(1);
+        }
+        struct stat fileStat;
+        fstat(fd, &fileStat);
+        u64 fileSize = fileStat.st_size;
 
-            while (currentPtr - inputChunk < chunkLen) {
-                // Batchfy hashing & inserting
-                u32 i;
-                for (i = 0; i < BATCHSIZE && currentPtr - inputChunk < chunkLen; i++) {
-                    Hash(currentPtr, hashBuffer[i], lenBuffer[i]);
-                    ptrBuffer[i] = currentPtr;
-                    currentPtr += lenBuffer[i] + 1;
-                }
+        using Key = typename Internal::HashWidthKey<HashWidth>::type;
+        Internal::SeenSet<Key> seenSet(seenSetFile, threadNum);
+        u64 sizeBefore = seenSet.table.Size();
 
-                u32 bufLen = i;
-                for (i = 0; i < bufLen; i++) {
-                    if (i + PREFETCH_STRIDE < bufLen) ht.Prefetch(hashBuffer[i + PREFETCH_STRIDE]);
-                    if (ht.Insert(hashBuffer[i])) {
-                        while (currentBufBytes + lenBuffer[i] + 1 >= bufCapacity) {
-                            char* newThreadBuf = (char*)malloc(2 * bufCapacity);
-                            memcpy(newThreadBuf, threadBuf, currentBufBytes);
-                            free(threadBuf);
-                            threadBuf = newThreadBuf;
-                            bufCapacity *= 2;
-                        }
-                        memcpy(threadBuf + currentBufBytes, ptrBuffer[i], lenBuffer[i] + 1);
-                        currentBufBytes += lenBuffer[i] + 1;
-                    }
-                }
+        if (fileSize > 0) {
+            bool numa = Internal::NumaActive(options.numa);
+            const char* input = Internal::MapInput(fd, fileSize, numa, options.hugePages);
+            if (input == MAP_FAILED) {
+                perror("mmap");
+                close(fd);
+                exit(1);
             }
 
-            std::unique_lock<std::mutex> lock(stdoutMutex);
-            write(STDOUT_FILENO, threadBuf, currentBufBytes);
-            free(threadBuf);
+            Internal::RunChunks(seenSet.table, Internal::SplitWork(input, input + fileSize, threadNum), threadNum, numa, key);
+            Internal::UnmapInput(input, fileSize);
         }
+        close(fd);
 
-        const char* ClosestNewline(const char* input, const char* end) {
-            while(input < end && *input != '\n') input++;
-            return input;
+        if (append) {
+            seenSet.Save(seenSetFile);
         }
 
-        // Divide the input equally
-        std::vector<std::pair<const char*, u32>> DivideInput(
-            const char* beg, const char* end, u32 threadNum
-        ) {
-            u32 fileSize = end - beg;
-            u32 perChunkLen = fileSize / threadNum;
-
-            std::vector<std::pair<const char*, u32>> ret;
+        return seenSet.table.Size() - sizeBefore;
+    }
 
-            const char* prev = beg;
-            u32 i = 0;
-            for (; i < threadNum; i++) {
-                if (i == threadNum - 1) {
-                    ret.push_back(std::make_pair(prev, end - prev));
-                } else {
-                    const char* next = ClosestNewline(prev + perChunkLen, end);
-                    if (next == end) {
-                        ret.push_back(std::make_pair(prev, end - prev));
-                        break;
-                    } else {
-                        ret.push_back(std::make_pair(prev, (next + 1) - prev));
-                        prev = next + 1;
-                    }
-                }
-            }
+    // Count the occurrences of each newline separated string in the input file,
+    // like `sort | uniq -c`. The counts are kept in the partitioned tables, so
+    // options.engine has no effect.
+    template <typename HashWidth = Hash64>
+    std::vector<std::pair<std::string, u64>> UniquifyCount(
+        const char *inputFile, u32 threadNum = 1, const Options &options = Options()
+    ) {
+        int fd = open(inputFile, O_RDONLY);
+        if (fd == -1) {
+            perror("open");
+            exit(1);
+        }
+        struct stat fileStat;
+        fstat(fd, &fileStat);
+        u64 fileSize = fileStat.st_size;
 
-            if (i != threadNum) {
-                for (; i < threadNum; i++) {
-                    ret.push_back(std::make_pair((const char*)NULL, 0U)); // Just add an empty chunk
-                }
-            }
+        if (fileSize == 0) {
+            close(fd);
+            return {};
+        }
 
-            return ret;
+        const char* input = Internal::MapInput(fd, fileSize, false, false);
+        if (input == MAP_FAILED) {
+            perror("mmap");
+            close(fd);
+            exit(1);
         }
-    } // namespace Internal
 
-    std::vector<std::string> ParallelMerge(
-        std::vector<std::vector<std::pair<const char*, u32>>> &uniqueStrings
-    ) {
-        std::vector<std::string> result;
+        auto chunks = Internal::DivideInput(input, input + fileSize, threadNum);
 
-        std::vector<u32> accum;
-        accum.push_back(0);
-        for (u32 i = 0; i < uniqueStrings.size(); i++) {
-            accum.push_back(accum.back() + uniqueStrings[i].size());
+        Internal::KeySpec keySpec(options);
+        const Internal::KeySpec* key = keySpec.Keyed() ? &keySpec : nullptr;
+
+        std::vector<std::vector<Internal::CountedLine>> results;
+        if (options.exact && key == nullptr) {
+            results = Internal::RunCounting<Internal::LineKey>(chunks, threadNum, options.ordered);
+        } else {
+            using Key = typename Internal::HashWidthKey<HashWidth>::type;
+            results = Internal::RunCounting<Key>(chunks, threadNum, options.ordered, key);
         }
 
-        result.resize(accum.back());
+        std::vector<u64> accum;
+        accum.push_back(0);
+        for (auto &result: results) {
+            accum.push_back(accum.back() + result.size());
+        }
 
-        omp_set_num_threads(uniqueStrings.size());
+        std::vector<std::pair<std::string, u64>> mergedResult(accum.back());
+        omp_set_num_threads(threadNum);
         #pragma omp parallel
         {
             int threadId = omp_get_thread_num();
-            auto dst = result.begin() + accum[threadId];
-            for (auto &src: uniqueStrings[threadId]) {
-                *(dst++) = std::string(src.first, src.second);
+            auto dst = mergedResult.begin() + accum[threadId];
+            for (auto &src: results[threadId]) {
+                *(dst++) = {std::string(src.ptr, src.len), src.count};
             }
         }
 
-        return result;
+        Internal::UnmapInput(input, fileSize);
+        close(fd);
+
+        return mergedResult;
     }
 
-    // Dedupliate newline separated strings in the input file
-    // and write deduplicated strings to stdout.
-    std::vector<std::string> Uniquify(const char *inputFile, u32 threadNum = 1) {
-        // TODO : error handling
+    // Same as UniquifyCount, but writes "count<TAB>line" to stdout and returns the
+    // number of unique strings.
+    template <typename HashWidth = Hash64>
+    u64 UniquifyCountToStdout(
+        const char *inputFile, u32 threadNum = 1, const Options &options = Options()
+    ) {
         int fd = open(inputFile, O_RDONLY);
         if (fd == -1) {
             perror("open");
@@ -376,56 +4501,52 @@ namespace FastUniq {
         }
         struct stat fileStat;
         fstat(fd, &fileStat);
-        u32 fileSize = fileStat.st_size;
+        u64 fileSize = fileStat.st_size;
 
         if (fileSize == 0) {
             close(fd);
-            return {};
+            return 0;
         }
 
-        const char* input = (const char*)mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+        const char* input = Internal::MapInput(fd, fileSize, false, false);
         if (input == MAP_FAILED) {
             perror("mmap");
             close(fd);
             exit(1);
         }
 
-        Internal::ParallelHashTable ht(threadNum);
-
-        std::mutex resultMutex;
-
         auto chunks = Internal::DivideInput(input, input + fileSize, threadNum);
 
-        std::vector<std::vector<std::pair<const char*, u32>>> results;
-        u32 resultCount = 0;
-
-        omp_set_num_threads(threadNum);
-        results.resize(threadNum);
-
-        #pragma omp parallel
-        {
-            int threadId = omp_get_thread_num();
-            const char* beg = chunks[threadId].first;
-            u32 len = chunks[threadId].second;
+        Internal::KeySpec keySpec(options);
+        const Internal::KeySpec* key = keySpec.Keyed() ? &keySpec : nullptr;
 
-            if (len > 0) {
-                results[threadId] = Internal::ProcessChunkVec(ht, beg, len);
-            }
-            resultCount += results[threadId].size();
+        std::vector<std::vector<Internal::CountedLine>> results;
+        if (options.exact && key == nullptr) {
+            results = Internal::RunCounting<Internal::LineKey>(chunks, threadNum, options.ordered);
+        } else {
+            using Key = typename Internal::HashWidthKey<HashWidth>::type;
+            results = Internal::RunCounting<Key>(chunks, threadNum, options.ordered, key);
         }
+        Internal::WriteCountedStrings(results, threadNum, options.ordered);
 
-        auto mergedResult = ParallelMerge(results);
+        u64 uniqueCount = 0;
+        for (auto &result: results) {
+            uniqueCount += result.size();
+        }
 
-        munmap((void*)input, fileSize);
+        Internal::UnmapInput(input, fileSize);
         close(fd);
 
-        return mergedResult;
+        return uniqueCount;
     }
 
-    // Dedupliate newline separated strings in the input file
-    // and write deduplicated strings to stdout.
-    u32 UniquifyToStdout(const char *inputFile, u32 threadNum = 1) {
-        // TODO : error handling
+    // Return the k most frequent newline separated strings in the input file with their
+    // counts, most frequent first. Strings with the same count are ordered by their first
+    // occurrence. Like UniquifyCount, options.engine has no effect.
+    template <typename HashWidth = Hash64>
+    std::vector<std::pair<std::string, u64>> TopK(
+        const char *inputFile, u32 k, u32 threadNum = 1, const Options &options = Options()
+    ) {
         int fd = open(inputFile, O_RDONLY);
         if (fd == -1) {
             perror("open");
@@ -433,40 +4554,74 @@ namespace FastUniq {
         }
         struct stat fileStat;
         fstat(fd, &fileStat);
-        u32 fileSize = fileStat.st_size;
+        u64 fileSize = fileStat.st_size;
 
         if (fileSize == 0) {
             close(fd);
-            return 0;
+            return {};
         }
 
-        const char* input = (const char*)mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+        const char* input = Internal::MapInput(fd, fileSize, false, false);
         if (input == MAP_FAILED) {
             perror("mmap");
             close(fd);
             exit(1);
         }
 
-        Internal::ParallelHashTable ht(threadNum);
+        auto chunks = Internal::DivideInput(input, input + fileSize, threadNum);
 
-        std::mutex stdoutMutex;
+        Internal::KeySpec keySpec(options);
+        const Internal::KeySpec* key = keySpec.Keyed() ? &keySpec : nullptr;
 
-        auto chunks = Internal::DivideInput(input, input + fileSize, threadNum);
+        std::vector<Internal::CountedLine> topK;
+        if (options.exact && key == nullptr) {
+            topK = Internal::RunTopK<Internal::LineKey>(chunks, k, threadNum);
+        } else {
+            using Key = typename Internal::HashWidthKey<HashWidth>::type;
+            topK = Internal::RunTopK<Key>(chunks, k, threadNum, key);
+        }
 
-        omp_set_num_threads(threadNum);
-        #pragma omp parallel 
-        {
-            int thread_id = omp_get_thread_num();
-            const char* beg = chunks[thread_id].first;
-            u32 len = chunks[thread_id].second;
-            if (len > 0) {
-                ProcessChunk(ht, beg, len, stdoutMutex);
-            }
+        std::vector<std::pair<std::string, u64>> result;
+        for (auto &line: topK) {
+            result.emplace_back(std::string(line.ptr, line.len), line.count);
         }
 
-        munmap((void*)input, fileSize);
+        Internal::UnmapInput(input, fileSize);
         close(fd);
 
-        return ht.Size();
+        return result;
+    }
+
+    // Dedupliate newline separated strings read from fd (e.g. a pipe or a socket)
+    // and write deduplicated strings to stdout. Memory used for the input is bounded
+    // by a few blocks per thread, independent of the length of the input.
+    // Engine::Auto and Engine::Partitioned fall back to Engine::BucketMutex.
+    // With options.ordered, the lines are hashed in parallel but inserted into a single
+    // table block by block, so the engine has no effect.
+    template <typename HashWidth = Hash64>
+    u64 UniquifyStream(int fd, u32 threadNum = 1, const Options &options = Options()) {
+        using Key = typename Internal::HashWidthKey<HashWidth>::type;
+        Internal::KeySpec keySpec(options);
+        const Internal::KeySpec* key = keySpec.Keyed() ? &keySpec : nullptr;
+        bool exact = options.exact && key == nullptr;
+        if (options.ordered) {
+            if (exact) {
+                return Internal::RunStreamOrdered<Internal::LineKey>(fd, threadNum);
+            }
+            return Internal::RunStreamOrdered<Key>(fd, threadNum, key);
+        } else if (exact) {
+            // The tables keep their own copies of the lines, so blocks can be reused
+            Internal::ParallelHashTable<Internal::LineKey> ht(threadNum);
+            Internal::RunStream(ht, fd, threadNum);
+            return ht.Size();
+        } else if (options.engine == Engine::LockFree && std::is_same_v<Key, u64>) {
+            Internal::LockFreeHashTable ht(threadNum + 1);
+            Internal::RunStream(ht, fd, threadNum, key);
+            return ht.Size();
+        } else {
+            Internal::ParallelHashTable<Key> ht(threadNum);
+            Internal::RunStream(ht, fd, threadNum, key);
+            return ht.Size();
+        }
     }
 } // namespace FastUniq
\ No newline at end of file
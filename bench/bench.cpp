@@ -17,8 +17,30 @@ int main(int argc, char** argv) {
     cmdline::parser p;
     p.add<unsigned>("lines", 'l', "Number of lines", false, 30000000, cmdline::range(1, INT_MAX));
     p.add<unsigned>("max-length", 'm', "Maximum length of a string", false, 16, cmdline::range(1, INT_MAX));
+    p.add<unsigned>("min-length", 'n', "Minimum length of a string", false, 1, cmdline::range(1, INT_MAX));
     p.add<unsigned>("unique-strings", 'u', "Number of unique strings", false, 1000000, cmdline::range(1, INT_MAX));
     p.add("vector", 'v', "Use Uniquify function, which returns a vector of unique strings");
+    p.add<std::string>("engine", 'e', "Execution strategy", false, "auto", cmdline::oneof<std::string>("auto", "bucket", "lockfree", "partitioned"));
+    p.add("exact", 'x', "Use the exact mode, which compares strings when hashes match");
+    p.add("hash128", 'w', "Keep 128-bit hashes in the tables");
+    p.add<std::string>("kernel", 'K', "Hash kernel (auto: best one supported by the CPU)", false, "auto", cmdline::oneof<std::string>("auto", "scalar", "sse42", "avx2", "avx512"));
+    p.add("ordered", 'o', "Write unique strings in the order of their first occurrence");
+    p.add<unsigned>("memory-limit", 'M', "Memory limit in MiB, beyond which the partitions spill to disk (0: unlimited)", false, 0);
+    p.add("count", 'c', "Use UniquifyCountToStdout, which counts the occurrences of each string");
+    p.add<unsigned>("top-k", 'k', "Use TopK with this k (0: disabled)", false, 0);
+    p.add<double>("zipf", 'z', "Draw duplicated lines from a Zipf distribution with this exponent (0: uniform)", false, 0);
+    p.add<unsigned>("files", 'F', "Split the input into this many files, half of it in the first one, and use UniquifyFilesToStdout (0: disabled)", false, 0);
+    p.add("numa", 'N', "Pin the threads to the NUMA nodes and place the input and the tables on them");
+    p.add<unsigned>("work-unit", 'W', "Size of the work units in KiB (0: derived from the input, a huge value: one unit per thread)", false, 0);
+    p.add("skew", 'S', "Make the first quarter of the input a quarter of the unique strings, 8 times longer than the others");
+    p.add("presize", 'P', "Size the tables up front from a HyperLogLog estimate of the number of unique strings");
+    p.add("huge-pages", 'H', "Also measure with huge pages and report the speedup");
+    p.add("insert-latency", 'L', "Measure the latency of every insert into the buckets, with and without incremental growth");
+    p.add("distinct-count", 'D', "Use CountDistinct, which counts the unique strings without writing them, and also measure CountDistinctApprox");
+    p.add("key-field", 'T', "Append a tab and a random field to every line, and deduplicate on the first field only");
+    p.add("json", 'J', "Write every line as a JSON object holding it in \"id\" between a random \"ts\" and \"msg\", and deduplicate on \"id\"");
+    p.add("exact-overhead", 'X', "Also measure the exact mode and report its overhead");
+    p.add("large-file", 'g', "Keep appending duplicated lines until the input file exceeds 4 GiB");
     p.add("help", 'h', "print help");
 
     if (!p.parse(argc, argv) || p.exist("help")) {
@@ -28,7 +50,49 @@ int main(int argc, char** argv) {
 
     unsigned    l = p.get<unsigned>("lines");
     unsigned    m = p.get<unsigned>("max-length");
+    unsigned    n = p.get<unsigned>("min-length");
     unsigned    u = p.get<unsigned>("unique-strings");
+    unsigned    topK = p.get<unsigned>("top-k");
+
+    FastUniq::Options options;
+    std::string engine = p.get<std::string>("engine");
+    if (engine == "bucket") {
+        options.engine = FastUniq::Engine::BucketMutex;
+    } else if (engine == "lockfree") {
+        options.engine = FastUniq::Engine::LockFree;
+    } else if (engine == "partitioned") {
+        options.engine = FastUniq::Engine::Partitioned;
+    }
+    options.exact = p.exist("exact");
+
+    std::string kernel = p.get<std::string>("kernel");
+    if (kernel != "auto") {
+        using FastUniq::Internal::KernelIsa;
+        KernelIsa isa = kernel == "scalar" ? KernelIsa::Scalar
+            : kernel == "sse42" ? KernelIsa::SSE42
+            : kernel == "avx2" ? KernelIsa::AVX2 : KernelIsa::AVX512;
+        if (!FastUniq::Internal::IsaSupported(isa)) {
+            std::cerr << "Error: The CPU does not support the " << kernel << " kernel\n";
+            return 1;
+        }
+        FastUniq::Internal::SetKernel(isa);
+    }
+    options.ordered = p.exist("ordered");
+    options.memoryLimit = (uint64_t)p.get<unsigned>("memory-limit") << 20;
+    options.numa = p.exist("numa");
+    options.presize = p.exist("presize");
+    if (p.exist("key-field")) {
+        options.keyFields = {1};
+    }
+    if (p.exist("json")) {
+        options.jsonKeys = {"id"};
+    }
+    FastUniq::Internal::WorkUnitSize = (uint64_t)p.get<unsigned>("work-unit") << 10;
+
+    if (n > m) {
+        std::cerr << "Error: Invalid input. The minimum length (-n) should be equal to or less than the maximum length (-m)\n";
+        return 1;
+    }
 
     if (l < u) {
         std::cerr << "Error: Invalid input. The number of unique strings (-u) should be equal to or less than the number of lines (-l)\n";
@@ -41,12 +105,15 @@ int main(int argc, char** argv) {
     char **uniqueStrings = (char **)malloc(sizeof(char*) * u);
     unsigned *len = (unsigned*)malloc(sizeof(unsigned) * u);
 
+    // With skew, the strings below skewU are longer and make up the first quarter of the lines
+    unsigned skewU = p.exist("skew") ? u / 4 : 0;
+
     std::random_device seed;
     std::mt19937 rng(seed());
     for (unsigned i = 0; i < u; i++) {
         unsigned counter = 0;
         while (true) {
-            unsigned length = rng() % m + 1;
+            unsigned length = (rng() % (m - n + 1) + n) * (i < skewU ? 8 : 1);
             std::string s = "";
             for (unsigned j = 0; j < length; j++) {
                 s.push_back(rng() % 26 + 'a');
@@ -79,57 +146,201 @@ int main(int argc, char** argv) {
     }
 
     {
+        constexpr uint64_t LARGE_FILE_SIZE = (4ULL << 30) + (256ULL << 20);
         std::ofstream tmpFile(fileName);
-        for (unsigned i = 0; i < l; i++) {
-            if (i < u) {
-                std::string s(uniqueStrings[i], len[i]);
-                tmpFile << s << "\n";
-            } else {
-                unsigned idx = rng() % u;
-                std::string s(uniqueStrings[idx], len[idx]);
-                tmpFile << s << "\n";
+        uint64_t writtenBytes = 0;
+        double zipf = p.get<double>("zipf");
+        std::vector<double> weights;
+        for (unsigned i = 0; zipf > 0 && i < u; i++) {
+            weights.push_back(1 / std::pow(i + 1, zipf));
+        }
+        std::discrete_distribution<unsigned> zipfDist(weights.begin(), weights.end());
+        for (uint64_t i = 0; i < l || (p.exist("large-file") && writtenBytes < LARGE_FILE_SIZE); i++) {
+            unsigned idx = (i < u) ? i : (zipf > 0 ? zipfDist(rng) : rng() % u);
+            if (skewU > 0 && i >= u) {
+                idx = (i < l / 4) ? rng() % skewU : skewU + rng() % (u - skewU);
+            }
+            std::string jsonTail;
+            if (p.exist("json")) {
+                std::string head = "{\"ts\": " + std::to_string(rng()) + ", \"id\": \"";
+                jsonTail = "\", \"msg\": \"" + std::string(8 + rng() % 8, 'a' + rng() % 26) + "\"}";
+                tmpFile << head;
+                writtenBytes += head.size() + jsonTail.size();
             }
+            tmpFile.write(uniqueStrings[idx], len[idx]);
+            tmpFile << jsonTail;
+            writtenBytes += len[idx] + 1;
+            if (p.exist("key-field")) {
+                char field[10] = {'\t'};
+                for (unsigned j = 1; j < 10; j++) field[j] = rng() % 26 + 'a';
+                tmpFile.write(field, 10);
+                writtenBytes += 10;
+            }
+            tmpFile.put('\n');
         }
     }
 
-    unsigned fileSize = std::filesystem::file_size(fileName);
+    uint64_t fileSize = std::filesystem::file_size(fileName);
+    std::cerr << "Input file size : " << fileSize << " bytes\n";
+
+    // One file gets the first half of the input, and the others share the rest evenly
+    unsigned fileNum = p.get<unsigned>("files");
+    std::vector<std::string> shardNames;
+    if (fileNum > 0) {
+        std::ifstream input(fileName);
+        uint64_t readBytes = 0;
+        std::string line;
+        for (unsigned i = 0; i < fileNum; i++) {
+            char shardName[] = "/tmp/tempshardXXXXXX";
+            close(mkstemp(shardName));
+            shardNames.push_back(shardName);
+            std::ofstream shard(shardName);
+            uint64_t shardEnd = (i == 0) ? fileSize / 2 : fileSize / 2 + (fileSize - fileSize / 2) * i / std::max(fileNum - 1, 1u);
+            while ((i == fileNum - 1 || readBytes < shardEnd) && std::getline(input, line)) {
+                shard << line << '\n';
+                readBytes += line.size() + 1;
+            }
+        }
+    }
 
     freopen("/dev/null", "w", stdout);
 
     constexpr unsigned BENCH_REPEAT = 10;
-    for (unsigned threadNum = 1; threadNum <= omp_get_num_procs(); threadNum++) {
-        std::cerr << threadNum << ((threadNum == 1) ? " thread : " : " threads : ");
+    // Returns the average run time in milliseconds, or a negative value if the result is wrong
+    auto measure = [&](unsigned threadNum, const FastUniq::Options &benchOptions) -> double {
         double runTimeSum = 0;
         // Take average of BENCH_REPEAT times
-        if (p.exist("vector")) { 
-            for (unsigned i = 0; i < BENCH_REPEAT; i++) {
-                auto start = std::chrono::high_resolution_clock::now();
-                std::vector<std::string> uniqueCount = FastUniq::Uniquify(fileName, threadNum);
-                auto end = std::chrono::high_resolution_clock::now();
-                runTimeSum += std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
-                if (uniqueCount.size() != u) {
-                    std::cerr << "Error: The number of unique strings is incorrect: ";
-                    std::cerr << "Correct: " << u << " Returned answer: " << uniqueCount.size() << "\n";
-                    return 1;
-                }
+        for (unsigned i = 0; i < BENCH_REPEAT; i++) {
+            uint64_t uniqueCount;
+            auto start = std::chrono::high_resolution_clock::now();
+            if (p.exist("vector") && p.exist("hash128")) {
+                uniqueCount = FastUniq::Uniquify<FastUniq::Hash128>(fileName, threadNum, benchOptions).size();
+            } else if (p.exist("vector")) {
+                uniqueCount = FastUniq::Uniquify(fileName, threadNum, benchOptions).size();
+            } else if (topK > 0) {
+                // Only the size of the result can be checked here
+                size_t resultSize = FastUniq::TopK(fileName, topK, threadNum, benchOptions).size();
+                uniqueCount = (resultSize == std::min(topK, u)) ? u : resultSize;
+            } else if (fileNum > 0) {
+                uniqueCount = FastUniq::UniquifyFilesToStdout(shardNames, threadNum, benchOptions);
+            } else if (p.exist("distinct-count")) {
+                uniqueCount = FastUniq::CountDistinct(fileName, threadNum, benchOptions);
+            } else if (p.exist("count")) {
+                uniqueCount = FastUniq::UniquifyCountToStdout(fileName, threadNum, benchOptions);
+            } else if (p.exist("hash128")) {
+                uniqueCount = FastUniq::UniquifyToStdout<FastUniq::Hash128>(fileName, threadNum, benchOptions);
+            } else {
+                uniqueCount = FastUniq::UniquifyToStdout(fileName, threadNum, benchOptions);
+            }
+            auto end = std::chrono::high_resolution_clock::now();
+            runTimeSum += std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
+            if (uniqueCount != u) {
+                std::cerr << "Error: The number of unique strings is incorrect: ";
+                std::cerr << "Correct: " << u << " Returned answer: " << uniqueCount << "\n";
+                return -1;
+            }
+        }
+        return runTimeSum / BENCH_REPEAT;
+    };
+
+    // Inserts the hashes of all lines into a ParallelHashTable, timing each insert, and
+    // reports the percentiles of all inserts and of the worst insert of each bucket
+    auto measureLatency = [&](unsigned threadNum, bool incremental) {
+        int inputFd = open(fileName, O_RDONLY);
+        const char* input = (const char*)mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE | MAP_POPULATE, inputFd, 0);
+        auto chunks = FastUniq::Internal::DivideInput(input, input + fileSize, threadNum);
+        FastUniq::Internal::ParallelHashTable<> ht(threadNum);
+        ht.SetIncremental(incremental);
+        std::vector<std::vector<uint64_t>> latencies(threadNum);
+        std::vector<std::vector<uint64_t>> bucketWorst(threadNum, std::vector<uint64_t>(ht.BucketNum()));
+
+        omp_set_num_threads(threadNum);
+        #pragma omp parallel
+        {
+            int threadId = omp_get_thread_num();
+            const char* ptr = chunks[threadId].first;
+            const char* end = ptr + chunks[threadId].second;
+            while (ptr < end) {
+                uint64_t hash;
+                uint32_t len;
+                FastUniq::Internal::Hash(ptr, hash, len);
+                ptr += len + 1;
+                auto start = std::chrono::steady_clock::now();
+                ht.Insert(hash);
+                uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+                latencies[threadId].push_back(ns);
+                uint64_t &worst = bucketWorst[threadId][ht.BucketIdx(hash)];
+                worst = std::max(worst, ns);
+            }
+        }
+        munmap((void*)input, fileSize);
+        close(inputFd);
+
+        std::vector<uint64_t> all, worst(ht.BucketNum());
+        for (unsigned t = 0; t < threadNum; t++) {
+            all.insert(all.end(), latencies[t].begin(), latencies[t].end());
+            for (size_t b = 0; b < worst.size(); b++) {
+                worst[b] = std::max(worst[b], bucketWorst[t][b]);
             }
-        } else {
+        }
+        std::sort(all.begin(), all.end());
+        std::sort(worst.begin(), worst.end());
+        auto percentile = [](const std::vector<uint64_t> &v, double q) {
+            return v.empty() ? 0 : v[std::min((size_t)(v.size() * q), v.size() - 1)];
+        };
+        std::cerr << (incremental ? "incremental" : "full rehash") << " : p50 " << percentile(all, 0.5) << " ns, p99.9 " << percentile(all, 0.999);
+        std::cerr << " ns, max " << all.back() << " ns, worst insert per bucket : median " << percentile(worst, 0.5) << " ns, max " << worst.back() << " ns";
+    };
+
+    for (unsigned threadNum = 1; threadNum <= omp_get_num_procs(); threadNum++) {
+        std::cerr << threadNum << ((threadNum == 1) ? " thread : " : " threads : ");
+        if (p.exist("insert-latency")) {
+            measureLatency(threadNum, true);
+            std::cerr << "\n    ";
+            measureLatency(threadNum, false);
+            std::cerr << "\n";
+            continue;
+        }
+        double runTime = measure(threadNum, options);
+        if (runTime < 0) return 1;
+
+        double throughput = fileSize / runTime / 1e3; // in megabytes
+        std::cerr << throughput << " MB/s (average: " << runTime << " ms)";
+
+        if (p.exist("exact-overhead")) {
+            FastUniq::Options exactOptions = options;
+            exactOptions.exact = true;
+            double exactRunTime = measure(threadNum, exactOptions);
+            if (exactRunTime < 0) return 1;
+            std::cerr << ", exact : " << fileSize / exactRunTime / 1e3 << " MB/s (average: " << exactRunTime << " ms, ";
+            std::cerr << "overhead: " << (exactRunTime / runTime - 1) * 100 << "%)";
+        }
+        if (p.exist("distinct-count")) {
+            double approxRunTimeSum = 0;
+            uint64_t estimate = 0;
             for (unsigned i = 0; i < BENCH_REPEAT; i++) {
                 auto start = std::chrono::high_resolution_clock::now();
-                unsigned uniqueCount = FastUniq::UniquifyToStdout(fileName, threadNum);
+                estimate = FastUniq::CountDistinctApprox(fileName, threadNum);
                 auto end = std::chrono::high_resolution_clock::now();
-                runTimeSum += std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
-                if (uniqueCount != u) {
-                    std::cerr << "Error: The number of unique strings is incorrect: ";
-                    std::cerr << "Correct: " << u << " Returned answer: " << uniqueCount << "\n";
-                    return 1;
-                }
+                approxRunTimeSum += std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
             }
+            double approxRunTime = approxRunTimeSum / BENCH_REPEAT;
+            std::cerr << ", approx : " << fileSize / approxRunTime / 1e3 << " MB/s (average: " << approxRunTime << " ms, ";
+            std::cerr << "error: " << ((double)estimate / u - 1) * 100 << "%)";
         }
-
-        double throughput = fileSize / (runTimeSum / BENCH_REPEAT) / 1e3; // in megabytes
-        std::cerr << throughput << " MB/s (average: " << (runTimeSum / BENCH_REPEAT) << " ms)\n";
+        if (p.exist("huge-pages")) {
+            FastUniq::Options hugeOptions = options;
+            hugeOptions.hugePages = true;
+            double hugeRunTime = measure(threadNum, hugeOptions);
+            if (hugeRunTime < 0) return 1;
+            std::cerr << ", huge pages : " << fileSize / hugeRunTime / 1e3 << " MB/s (average: " << hugeRunTime << " ms, ";
+            std::cerr << "speedup: " << runTime / hugeRunTime << "x)";
+        }
+        std::cerr << "\n";
     }
 
     std::remove(fileName);
+    for (auto &shardName: shardNames) {
+        std::remove(shardName.data());
+    }
 }
\ No newline at end of file
@@ -1,9 +1,20 @@
 #include "../FastUniq.hpp"
 #include <unordered_set>
+#include <unordered_map>
 #include <fstream>
+#include <random>
+#include <set>
+#include <map>
+#include <array>
+#include <sys/wait.h>
 
 void Tester(std::string desctiption, std::vector<std::string> v) {
     std::unordered_set<std::string> stringSet(v.begin(), v.end());
+    std::vector<std::string> firstOccurrences;
+    std::unordered_map<std::string, uint64_t> counts;
+    for (auto &s: v) {
+        if (counts[s]++ == 0) firstOccurrences.push_back(s);
+    }
 
     char fileName[] = "/tmp/tempfileXXXXXX";
     int fd = mkstemp(fileName);
@@ -21,21 +32,808 @@ void Tester(std::string desctiption, std::vector<std::string> v) {
 
     freopen("/dev/null", "w", stdout);
 
-    // Test changing the number of threads
-    for (unsigned i = 0; i < omp_get_num_procs(); i++) {
-        unsigned result = FastUniq::Uniquify(fileName);
+    auto check = [&](const char* api, unsigned threadNum, size_t result) {
         if (result != stringSet.size()) {
-            fprintf(stderr, "Test \"%s\" failed! : ", desctiption.data());
-            fprintf(stderr, "Expected=%lu vs. Result=%u\n", stringSet.size(), result);
+            fprintf(stderr, "Test \"%s\" failed! (%s, %u threads) : ", desctiption.data(), api, threadNum);
+            fprintf(stderr, "Expected=%lu vs. Result=%lu\n", stringSet.size(), result);
+            std::remove(fileName);
+            exit(1);
+        }
+    };
+
+    // Test changing the number of threads and the table engine
+    for (FastUniq::Engine engine: {
+        FastUniq::Engine::Auto, FastUniq::Engine::BucketMutex,
+        FastUniq::Engine::LockFree, FastUniq::Engine::Partitioned
+    }) {
+        for (bool exact: {false, true}) {
+            FastUniq::Options options;
+            options.engine = engine;
+            options.exact = exact;
+            for (unsigned i = 1; i <= (unsigned)omp_get_num_procs(); i++) {
+                check("UniquifyToStdout", i, FastUniq::UniquifyToStdout(fileName, i, options));
+                std::vector<std::string> result = FastUniq::Uniquify(fileName, i, options);
+                check("Uniquify", i, std::unordered_set<std::string>(result.begin(), result.end()).size());
+                int inputFd = open(fileName, O_RDONLY);
+                check("UniquifyStream", i, FastUniq::UniquifyStream(inputFd, i, options));
+                close(inputFd);
+            }
+        }
+
+        FastUniq::Options options;
+        options.engine = engine;
+        for (unsigned i = 1; i <= (unsigned)omp_get_num_procs(); i++) {
+            check("UniquifyToStdout<Hash128>", i, FastUniq::UniquifyToStdout<FastUniq::Hash128>(fileName, i, options));
+            std::vector<std::string> result = FastUniq::Uniquify<FastUniq::Hash128>(fileName, i, options);
+            check("Uniquify<Hash128>", i, std::unordered_set<std::string>(result.begin(), result.end()).size());
+            int inputFd = open(fileName, O_RDONLY);
+            check("UniquifyStream<Hash128>", i, FastUniq::UniquifyStream<FastUniq::Hash128>(inputFd, i, options));
+            close(inputFd);
+        }
+    }
+
+    // The ordered mode must produce exactly the first occurrences in input order
+    auto checkOrder = [&](const char* api, unsigned threadNum, const std::vector<std::string> &result) {
+        if (result != firstOccurrences) {
+            fprintf(stderr, "Test \"%s\" failed! (%s ordered, %u threads) : wrong order\n", desctiption.data(), api, threadNum);
+            std::remove(fileName);
+            exit(1);
+        }
+    };
+    // Run f with stdout redirected to a file and return the lines written
+    char outName[] = "/tmp/tempoutXXXXXX";
+    close(mkstemp(outName));
+    auto captureStdout = [&](auto f) {
+        freopen(outName, "w", stdout);
+        f();
+        freopen("/dev/null", "w", stdout);
+        std::vector<std::string> lines;
+        std::ifstream outFile(outName);
+        for (std::string line; std::getline(outFile, line); ) {
+            lines.push_back(line);
+        }
+        return lines;
+    };
+    for (bool exact: {false, true}) {
+        FastUniq::Options options;
+        options.ordered = true;
+        options.exact = exact;
+        for (unsigned i = 1; i <= (unsigned)omp_get_num_procs(); i++) {
+            checkOrder("UniquifyToStdout", i, captureStdout([&] { FastUniq::UniquifyToStdout(fileName, i, options); }));
+            checkOrder("Uniquify", i, FastUniq::Uniquify(fileName, i, options));
+            // The views must stay valid when the result is moved
+            FastUniq::UniqueResult views = FastUniq::Uniquify(fileName, i, options);
+            FastUniq::UniqueResult moved = std::move(views);
+            checkOrder("Uniquify (views)", i, std::vector<std::string>(moved.begin(), moved.end()));
+            checkOrder("UniquifyStream", i, captureStdout([&] {
+                int inputFd = open(fileName, O_RDONLY);
+                FastUniq::UniquifyStream(inputFd, i, options);
+                close(inputFd);
+            }));
+        }
+    }
+
+    // A tiny memory limit makes the records spill to disk and the partitions be
+    // deduplicated in rounds
+    for (bool exact: {false, true}) {
+        FastUniq::Options options;
+        options.memoryLimit = 1;
+        options.exact = exact;
+        for (unsigned i = 1; i <= (unsigned)omp_get_num_procs(); i++) {
+            check("UniquifyToStdout (memoryLimit)", i, FastUniq::UniquifyToStdout(fileName, i, options));
+            check("UniquifyToStdout<Hash128> (memoryLimit)", i, FastUniq::UniquifyToStdout<FastUniq::Hash128>(fileName, i, options));
+            std::vector<std::string> result = FastUniq::Uniquify(fileName, i, options);
+            check("Uniquify (memoryLimit)", i, std::unordered_set<std::string>(result.begin(), result.end()).size());
+            options.ordered = true;
+            checkOrder("Uniquify (memoryLimit)", i, FastUniq::Uniquify(fileName, i, options));
+            options.ordered = false;
+        }
+    }
+
+    // Tiny work units make the threads steal most of them from each other. More threads
+    // than processors leave some threads without a unit of their own.
+    FastUniq::Internal::WorkUnitSize = 1;
+    for (FastUniq::Engine engine: {FastUniq::Engine::BucketMutex, FastUniq::Engine::LockFree}) {
+        FastUniq::Options options;
+        options.engine = engine;
+        for (unsigned i = 1; i <= (unsigned)omp_get_num_procs() + 2; i++) {
+            check("UniquifyToStdout (work units)", i, FastUniq::UniquifyToStdout(fileName, i, options));
+            std::vector<std::string> result = FastUniq::Uniquify(fileName, i, options);
+            check("Uniquify (work units)", i, std::unordered_set<std::string>(result.begin(), result.end()).size());
+        }
+    }
+    FastUniq::Internal::WorkUnitSize = 0;
+
+    // The NUMA mode must give the same strings, whether or not the machine has several nodes
+    for (FastUniq::Engine engine: {FastUniq::Engine::BucketMutex, FastUniq::Engine::LockFree, FastUniq::Engine::Partitioned}) {
+        FastUniq::Options options;
+        options.engine = engine;
+        options.numa = true;
+        for (unsigned i = 1; i <= (unsigned)omp_get_num_procs(); i++) {
+            check("UniquifyToStdout (numa)", i, FastUniq::UniquifyToStdout(fileName, i, options));
+            std::vector<std::string> result = FastUniq::Uniquify(fileName, i, options);
+            check("Uniquify (numa)", i, std::unordered_set<std::string>(result.begin(), result.end()).size());
+        }
+    }
+
+    for (FastUniq::Engine engine: {FastUniq::Engine::BucketMutex, FastUniq::Engine::LockFree, FastUniq::Engine::Partitioned}) {
+        FastUniq::Options options;
+        options.engine = engine;
+        options.hugePages = true;
+        for (unsigned i = 1; i <= (unsigned)omp_get_num_procs(); i++) {
+            check("UniquifyToStdout (hugePages)", i, FastUniq::UniquifyToStdout(fileName, i, options));
+            std::vector<std::string> result = FastUniq::Uniquify(fileName, i, options);
+            check("Uniquify (hugePages)", i, std::unordered_set<std::string>(result.begin(), result.end()).size());
+        }
+    }
+
+    for (FastUniq::Engine engine: {FastUniq::Engine::BucketMutex, FastUniq::Engine::LockFree}) {
+        for (bool exact: {false, true}) {
+            FastUniq::Options options;
+            options.engine = engine;
+            options.exact = exact;
+            options.presize = true;
+            for (unsigned i = 1; i <= (unsigned)omp_get_num_procs(); i++) {
+                check("UniquifyToStdout (presize)", i, FastUniq::UniquifyToStdout(fileName, i, options));
+                std::vector<std::string> result = FastUniq::Uniquify(fileName, i, options);
+                check("Uniquify (presize)", i, std::unordered_set<std::string>(result.begin(), result.end()).size());
+            }
+        }
+    }
+
+    for (FastUniq::Engine engine: {
+        FastUniq::Engine::Auto, FastUniq::Engine::BucketMutex,
+        FastUniq::Engine::LockFree, FastUniq::Engine::Partitioned
+    }) {
+        for (bool exact: {false, true}) {
+            FastUniq::Options options;
+            options.engine = engine;
+            options.exact = exact;
+            for (unsigned i = 1; i <= (unsigned)omp_get_num_procs(); i++) {
+                check("CountDistinct", i, FastUniq::CountDistinct(fileName, i, options));
+                check("CountDistinct<Hash128>", i, FastUniq::CountDistinct<FastUniq::Hash128>(fileName, i, options));
+            }
+        }
+    }
+
+    // The estimate has a standard error of 0.8% with the default precision, and is exact
+    // in practice for a few strings
+    for (unsigned i = 1; i <= (unsigned)omp_get_num_procs(); i++) {
+        double estimate = FastUniq::CountDistinctApprox(fileName, i);
+        if (std::abs(estimate - (double)stringSet.size()) > stringSet.size() * 0.05) {
+            fprintf(stderr, "Test \"%s\" failed! (CountDistinctApprox, %u threads) : ", desctiption.data(), i);
+            fprintf(stderr, "Expected=%lu vs. Estimate=%.0f\n", stringSet.size(), estimate);
+            std::remove(fileName);
+            exit(1);
+        }
+    }
+
+    // The count mode must count every occurrence, and keep the order when ordered
+    auto checkCounts = [&](const char* api, unsigned threadNum, const std::vector<std::pair<std::string, uint64_t>> &result, bool ordered) {
+        std::unordered_map<std::string, uint64_t> resultCounts(result.begin(), result.end());
+        std::vector<std::string> order;
+        for (auto &p: result) order.push_back(p.first);
+        if (result.size() != counts.size() || resultCounts != counts || (ordered && order != firstOccurrences)) {
+            fprintf(stderr, "Test \"%s\" failed! (%s, %u threads) : wrong counts\n", desctiption.data(), api, threadNum);
+            std::remove(fileName);
+            exit(1);
+        }
+    };
+    auto parseCounts = [](const std::vector<std::string> &lines) {
+        std::vector<std::pair<std::string, uint64_t>> ret;
+        for (auto &line: lines) {
+            size_t tab = line.find('\t');
+            ret.emplace_back(line.substr(tab + 1), std::stoull(line.substr(0, tab)));
+        }
+        return ret;
+    };
+    for (bool exact: {false, true}) {
+        for (bool ordered: {false, true}) {
+            FastUniq::Options options;
+            options.exact = exact;
+            options.ordered = ordered;
+            for (unsigned i = 1; i <= (unsigned)omp_get_num_procs(); i++) {
+                checkCounts("UniquifyCount", i, FastUniq::UniquifyCount(fileName, i, options), ordered);
+                checkCounts("UniquifyCountToStdout", i, parseCounts(captureStdout([&] {
+                    FastUniq::UniquifyCountToStdout(fileName, i, options);
+                })), ordered);
+                checkCounts("UniquifyCount<Hash128>", i, FastUniq::UniquifyCount<FastUniq::Hash128>(fileName, i, options), ordered);
+            }
+        }
+    }
+
+    // UniquifyAgainst must write only the strings missing from the seen set, which is
+    // built from the first half of the input
+    char seenName[] = "/tmp/tempseenXXXXXX";
+    close(mkstemp(seenName));
+    char halfName[] = "/tmp/temphalfXXXXXX";
+    close(mkstemp(halfName));
+    {
+        std::ofstream halfFile(halfName);
+        for (unsigned i = 0; i < v.size() / 2; i++) {
+            halfFile << v[i] << "\n";
+        }
+    }
+    std::unordered_set<std::string> firstHalf(v.begin(), v.begin() + v.size() / 2);
+    std::unordered_set<std::string> unseen;
+    for (auto &s: stringSet) {
+        if (firstHalf.count(s) == 0) unseen.insert(s);
+    }
+    auto checkAgainst = [&](const char* api, unsigned threadNum, const std::vector<std::string> &result) {
+        if (result.size() != unseen.size() || std::unordered_set<std::string>(result.begin(), result.end()) != unseen) {
+            fprintf(stderr, "Test \"%s\" failed! (%s, %u threads) : wrong unseen strings\n", desctiption.data(), api, threadNum);
+            std::remove(fileName);
+            exit(1);
+        }
+    };
+    for (unsigned i = 1; i <= (unsigned)omp_get_num_procs(); i++) {
+        std::remove(seenName);
+        check("UniquifyAgainst (new set)", i, FastUniq::UniquifyAgainst(seenName, halfName, i, true) + stringSet.size() - firstHalf.size());
+        // The set is reloaded from the file each time, and not changed without append
+        for (unsigned repeat = 0; repeat < 2; repeat++) {
+            checkAgainst("UniquifyAgainst", i, captureStdout([&] { FastUniq::UniquifyAgainst(seenName, fileName, i); }));
+        }
+        checkAgainst("UniquifyAgainst (append)", i, captureStdout([&] { FastUniq::UniquifyAgainst(seenName, fileName, i, true); }));
+        check("UniquifyAgainst (appended set)", i, FastUniq::UniquifyAgainst(seenName, fileName, i) + stringSet.size());
+
+        std::remove(seenName);
+        FastUniq::UniquifyAgainst<FastUniq::Hash128>(seenName, halfName, i, true);
+        checkAgainst("UniquifyAgainst<Hash128>", i, captureStdout([&] { FastUniq::UniquifyAgainst<FastUniq::Hash128>(seenName, fileName, i); }));
+    }
+    std::remove(seenName);
+    std::remove(halfName);
+
+    // The input split into several files, with an empty one, must be deduplicated as one
+    char dirName[] = "/tmp/tempdirXXXXXX";
+    mkdtemp(dirName);
+    std::vector<std::string> parts;
+    for (unsigned part = 0; part < 4; part++) {
+        parts.push_back(std::string(dirName) + "/part" + std::to_string(part));
+        std::ofstream partFile(parts.back());
+        // Part 3 stays empty
+        for (unsigned i = part * v.size() / 3; part < 3 && i < (part + 1) * v.size() / 3; i++) {
+            partFile << v[i] << "\n";
+        }
+    }
+    auto checkFiles = [&](const char* api, unsigned threadNum, const std::vector<std::string> &result) {
+        if (result.size() != stringSet.size() || std::unordered_set<std::string>(result.begin(), result.end()) != stringSet) {
+            fprintf(stderr, "Test \"%s\" failed! (%s, %u threads) : wrong strings\n", desctiption.data(), api, threadNum);
             std::remove(fileName);
             exit(1);
         }
+    };
+    for (FastUniq::Engine engine: {FastUniq::Engine::Auto, FastUniq::Engine::LockFree}) {
+        for (bool exact: {false, true}) {
+            FastUniq::Options options;
+            options.engine = engine;
+            options.exact = exact;
+            options.presize = exact;
+            options.hugePages = !exact;
+            for (unsigned i = 1; i <= (unsigned)omp_get_num_procs(); i++) {
+                checkFiles("UniquifyFilesToStdout", i, captureStdout([&] { FastUniq::UniquifyFilesToStdout(parts, i, options); }));
+                std::string pattern = std::string(dirName) + "/part*";
+                check("UniquifyGlobToStdout", i, FastUniq::UniquifyGlobToStdout(pattern.data(), i, options));
+                check("UniquifyGlobToStdout<Hash128>", i, FastUniq::UniquifyGlobToStdout<FastUniq::Hash128>(pattern.data(), i, options));
+            }
+        }
+    }
+    for (auto &part: parts) {
+        std::remove(part.data());
+    }
+    std::remove(dirName);
+    std::remove(outName);
+
+    // TopK must return the most frequent strings, ties in the order of first occurrence
+    std::vector<std::pair<std::string, uint64_t>> byFrequency;
+    for (auto &s: firstOccurrences) byFrequency.emplace_back(s, counts[s]);
+    std::stable_sort(byFrequency.begin(), byFrequency.end(), [](auto &a, auto &b) { return a.second > b.second; });
+    for (unsigned k: {1u, 3u, (unsigned)firstOccurrences.size() + 1}) {
+        auto expected = byFrequency;
+        expected.resize(std::min((size_t)k, expected.size()));
+        for (bool exact: {false, true}) {
+            FastUniq::Options options;
+            options.exact = exact;
+            for (unsigned i = 1; i <= (unsigned)omp_get_num_procs(); i++) {
+                if (FastUniq::TopK(fileName, k, i, options) != expected) {
+                    fprintf(stderr, "Test \"%s\" failed! (TopK, k=%u, %u threads)\n", desctiption.data(), k, i);
+                    std::remove(fileName);
+                    exit(1);
+                }
+            }
+        }
     }
 
     fprintf(stderr, "\"%s\" passed\n", desctiption.data());
     std::remove(fileName);
 }
 
+// A last line without a newline must end at the end of the file, also when it is too
+// long for the length packed into a LineRecord and the file fills its last page
+void UnterminatedTester() {
+    for (size_t lastLen: {(size_t)70000, (size_t)81917}) {
+        std::string lastLine(lastLen, 'x');
+        // The second length makes the file exactly 40 pages of 4 KiB
+        std::vector<std::string> expected = {"ab", lastLine, "b"};
+
+        char fileName[] = "/tmp/tempunterminatedXXXXXX";
+        close(mkstemp(fileName));
+        {
+            std::ofstream tmpFile(fileName);
+            tmpFile << "ab\n" << lastLine << "\nb\n" << lastLine;
+        }
+
+        auto fail = [&](const char* api, unsigned threadNum) {
+            fprintf(stderr, "Test \"Unterminated last line\" failed! (%s, %lu bytes, %u threads)\n", api, lastLen, threadNum);
+            std::remove(fileName);
+            exit(1);
+        };
+        for (FastUniq::Engine engine: {FastUniq::Engine::BucketMutex, FastUniq::Engine::LockFree, FastUniq::Engine::Partitioned}) {
+            for (bool exact: {false, true}) {
+                for (unsigned mode = 0; mode < 3; mode++) {
+                    FastUniq::Options options;
+                    options.engine = engine;
+                    options.exact = exact;
+                    options.ordered = mode == 1;
+                    options.memoryLimit = mode == 2 ? 1 : 0;
+                    for (unsigned i = 1; i <= (unsigned)omp_get_num_procs(); i++) {
+                        std::vector<std::string> result = FastUniq::Uniquify(fileName, i, options);
+                        if (std::set<std::string>(result.begin(), result.end()) != std::set<std::string>(expected.begin(), expected.end())
+                            || result.size() != expected.size()) fail("Uniquify", i);
+                        if (options.ordered && result != expected) fail("Uniquify ordered", i);
+                        if (FastUniq::CountDistinct(fileName, i, options) != expected.size()) fail("CountDistinct", i);
+                        auto counts = FastUniq::UniquifyCount(fileName, i, options);
+                        if (counts.size() != expected.size()) fail("UniquifyCount", i);
+                        auto top = FastUniq::TopK(fileName, 1, i, options);
+                        if (top.size() != 1 || top[0].first != lastLine || top[0].second != 2) fail("TopK", i);
+                    }
+                }
+            }
+        }
+        std::remove(fileName);
+    }
+    fprintf(stderr, "\"Unterminated last line\" passed\n");
+}
+
+// Strings whose hashes collide must be kept apart in the exact mode
+void CollisionTester() {
+    using namespace FastUniq::Internal;
+    const char input[] = "abc\nabd\nabc\nabcd\n";
+    const char* lines[] = {input, input + 4, input + 8, input + 12};
+    unsigned lens[] = {3, 3, 3, 4};
+    bool expected[] = {true, true, false, true};
+
+    ParallelHashTable<LineKey> ht(1);
+    for (unsigned i = 0; i < 4; i++) {
+        // Every line gets the same hash
+        if (ht.Insert(KeyTraits<LineKey>::Make(42, lines[i], lens[i])) != expected[i]) {
+            fprintf(stderr, "Test \"Hash collision\" failed! : line %u\n", i);
+            exit(1);
+        }
+    }
+    fprintf(stderr, "\"Hash collision\" passed\n");
+
+    // Swapping the 16-byte blocks of a line does not change its 64-bit hash,
+    // but it must change the 128-bit one
+    const char swapped[128] = "0123456789abcdefghijklmnopqrstuv\nghijklmnopqrstuv0123456789abcdef\n";
+    WideHash a, b;
+    unsigned lenA, lenB;
+    Hash(swapped, a, lenA);
+    Hash(swapped + 33, b, lenB);
+    if (lenA != 32 || lenB != 32 || KeyTraits<WideHash>::Equal(a, b)) {
+        fprintf(stderr, "Test \"128-bit hash of reordered blocks\" failed!\n");
+        exit(1);
+    }
+    fprintf(stderr, "\"128-bit hash of reordered blocks\" passed\n");
+}
+
+// Every kernel supported by the CPU must compute the same hashes as the scalar one
+void KernelTester() {
+    using namespace FastUniq::Internal;
+    std::vector<char> input;
+    std::mt19937 rng(1);
+    // Long lines first, which are hashed in lanes
+    std::vector<unsigned> lineLens = {1000, 4096 + 17};
+    for (unsigned len = 0; len <= 300; len++) lineLens.push_back(len);
+    for (unsigned len: lineLens) {
+        for (unsigned i = 0; i < len; i++) {
+            input.push_back('\n' + 1 + rng() % 200);
+        }
+        input.push_back('\n');
+    }
+    input.resize(input.size() + 64);
+
+    KernelIsa active = ActiveKernel.isa;
+    for (KernelIsa isa: {KernelIsa::SSE42, KernelIsa::AVX2, KernelIsa::AVX512}) {
+        if (!IsaSupported(isa)) continue;
+        // Also vary the alignment of the lines
+        for (unsigned offset = 0; offset < 64; offset += 7) {
+            std::vector<char> shifted(offset);
+            shifted.insert(shifted.end(), input.begin(), input.end());
+            for (const char* line = shifted.data() + offset; line < shifted.data() + shifted.size() - 64; ) {
+                uint64_t expected64, result64;
+                WideHash expected128, result128;
+                unsigned expectedLen, len64, len128;
+                SetKernel(KernelIsa::Scalar);
+                Hash(line, expected64, expectedLen);
+                Hash(line, expected128, expectedLen);
+                SetKernel(isa);
+                Hash(line, result64, len64);
+                Hash(line, result128, len128);
+                if (len64 != expectedLen || len128 != expectedLen || result64 != expected64
+                    || !KeyTraits<WideHash>::Equal(result128, expected128)) {
+                    fprintf(stderr, "Test \"Hash kernels\" failed! : kernel %d, length %u\n", (int)isa, expectedLen);
+                    exit(1);
+                }
+                line += expectedLen + 1;
+            }
+
+            // HashLines indexes the newlines of a batch before hashing it. The input is
+            // cut in the middle of a line, which must end at the end of the input.
+            // With a key, the fields and the JSON values are located with the masks of the
+            // kernel.
+            const char* end = shifted.data() + shifted.size() - 64 - 100;
+            FastUniq::Options keyOptions;
+            keyOptions.fieldSeparator = 'A';
+            keyOptions.keyFields = {2, 4, 5};
+            const KeySpec keySpec(keyOptions);
+            FastUniq::Options jsonOptions;
+            jsonOptions.jsonKeys = {"a", "b.c"};
+            const KeySpec jsonSpec(jsonOptions);
+            for (const KeySpec* key: {(const KeySpec*)nullptr, &keySpec, &jsonSpec}) {
+                std::vector<uint64_t> expected, result;
+                std::vector<unsigned> expectedLens, resultLens;
+                for (KernelIsa kernel: {KernelIsa::Scalar, isa}) {
+                    SetKernel(kernel);
+                    auto &hashes = kernel == KernelIsa::Scalar ? expected : result;
+                    auto &lens = kernel == KernelIsa::Scalar ? expectedLens : resultLens;
+                    for (const char* line = shifted.data() + offset; line < end; ) {
+                        // Small batches, so that both the indexed and the per-line paths are taken
+                        uint64_t batchHashes[40];
+                        unsigned batchLens[40];
+                        unsigned lineNum = HashLines(line, end, batchHashes, batchLens, 40, key);
+                        for (unsigned i = 0; i < lineNum; i++) {
+                            hashes.push_back(batchHashes[i]);
+                            lens.push_back(batchLens[i]);
+                            line += batchLens[i] + 1;
+                        }
+                    }
+                }
+                if (result != expected || resultLens != expectedLens || expectedLens.back() != 300 + 1 - 100) {
+                    fprintf(stderr, "Test \"Hash kernels\" failed! : HashLines of kernel %d%s\n", (int)isa,
+                        key == &keySpec ? " with key fields" : key == &jsonSpec ? " with JSON keys" : "");
+                    exit(1);
+                }
+            }
+        }
+    }
+    SetKernel(active);
+
+    // Lines differing only in their last block must get different hashes
+    const char tail[] = "0123456789abcdefXYZW\n0123456789abcdefXYZQ\n";
+    uint64_t a, b;
+    unsigned lenA, lenB;
+    Hash(tail, a, lenA);
+    Hash(tail + 21, b, lenB);
+    if (lenA != 20 || lenB != 20 || a == b) {
+        fprintf(stderr, "Test \"Hash of the last block\" failed!\n");
+        exit(1);
+    }
+    fprintf(stderr, "\"Hash kernels\" passed\n");
+}
+
+// The entry points other than Uniquify must agree with it on keyed options. expected holds
+// the first line of each key in input order, and counts the number of lines of each key.
+template <typename Fail>
+void KeyedApiTester(
+    const char* fileName, const FastUniq::Options &options, unsigned threadNum,
+    const std::vector<std::string> &expected, const std::vector<uint64_t> &counts, Fail fail
+) {
+    int inputFd = open(fileName, O_RDONLY);
+    if (FastUniq::UniquifyStream(inputFd, threadNum, options) != expected.size()) fail("UniquifyStream", threadNum);
+    close(inputFd);
+    // The second copy of the file only holds repeated keys. The options which need a
+    // single input are rejected by UniquifyFilesToStdout.
+    FastUniq::Options filesOptions = options;
+    if (filesOptions.engine == FastUniq::Engine::Partitioned) filesOptions.engine = FastUniq::Engine::Auto;
+    filesOptions.ordered = false;
+    filesOptions.memoryLimit = 0;
+    if (FastUniq::UniquifyFilesToStdout({fileName, fileName}, threadNum, filesOptions) != expected.size()) {
+        fail("UniquifyFilesToStdout", threadNum);
+    }
+    FastUniq::Options hashOptions = options;
+    hashOptions.exact = false;
+    std::string seenName = std::string(fileName) + ".seen";
+    if (FastUniq::UniquifyAgainst(seenName.data(), fileName, threadNum, false, hashOptions) != expected.size()) {
+        fail("UniquifyAgainst", threadNum);
+    }
+
+    std::vector<std::pair<std::string, uint64_t>> expectedCounts;
+    for (unsigned i = 0; i < expected.size(); i++) {
+        expectedCounts.emplace_back(expected[i], counts[i]);
+    }
+    auto result = FastUniq::UniquifyCount(fileName, threadNum, options);
+    if (!options.ordered) {
+        std::sort(result.begin(), result.end());
+    }
+    auto sortedCounts = expectedCounts;
+    if (!options.ordered) {
+        std::sort(sortedCounts.begin(), sortedCounts.end());
+    }
+    if (result != sortedCounts) fail("UniquifyCount", threadNum);
+    if (FastUniq::UniquifyCountToStdout(fileName, threadNum, options) != expected.size()) fail("UniquifyCountToStdout", threadNum);
+
+    std::stable_sort(expectedCounts.begin(), expectedCounts.end(), [](auto &a, auto &b) { return a.second > b.second; });
+    expectedCounts.resize(std::min((size_t)5, expectedCounts.size()));
+    if (FastUniq::TopK(fileName, 5, threadNum, options) != expectedCounts) fail("TopK", threadNum);
+}
+
+// Deduplicating on key fields must keep the first line of each key, like
+// `awk -F SEP '!seen[$2, $3]++'`. Fields missing from a line are empty.
+void KeyFieldTester() {
+    std::mt19937 rng(1);
+    for (char separator: {'\t', ','}) {
+        // Mostly short fields of a small alphabet, so that keys repeat, and some fields
+        // longer than a SIMD block
+        std::vector<std::string> lines;
+        for (unsigned i = 0; i < 20000; i++) {
+            std::string line;
+            unsigned fieldNum = rng() % 6;
+            for (unsigned f = 0; f < fieldNum; f++) {
+                if (f > 0) line.push_back(separator);
+                unsigned len = (rng() % 8 == 0) ? 40 + rng() % 60 : rng() % 3;
+                for (unsigned j = 0; j < len; j++) line.push_back('a' + rng() % 2);
+            }
+            lines.push_back(line);
+        }
+
+        char fileName[] = "/tmp/tempkeyXXXXXX";
+        close(mkstemp(fileName));
+        {
+            std::ofstream tmpFile(fileName);
+            for (auto &line: lines) tmpFile << line << "\n";
+        }
+
+        for (std::vector<uint32_t> keyFields: std::vector<std::vector<uint32_t>>{{2}, {2, 3}, {3, 1}, {5, 1, 5}}) {
+            std::map<std::vector<std::string>, unsigned> seen;
+            std::vector<std::string> expected;
+            std::vector<uint64_t> counts;
+            for (auto &line: lines) {
+                std::vector<std::string> fields(1);
+                for (char c: line) {
+                    if (c == separator) fields.emplace_back();
+                    else fields.back().push_back(c);
+                }
+                std::vector<std::string> key;
+                for (uint32_t field: keyFields) key.push_back(field <= fields.size() ? fields[field - 1] : "");
+                auto [it, inserted] = seen.emplace(key, expected.size());
+                if (inserted) {
+                    expected.push_back(line);
+                    counts.push_back(0);
+                }
+                counts[it->second]++;
+            }
+
+            auto fail = [&](const char* api, unsigned threadNum) {
+                fprintf(stderr, "Test \"Key fields\" failed! (%s, separator %d, %lu key fields, %u threads)\n",
+                    api, separator, keyFields.size(), threadNum);
+                std::remove(fileName);
+                exit(1);
+            };
+            std::unordered_set<std::string> expectedSet(expected.begin(), expected.end());
+            for (FastUniq::Engine engine: {FastUniq::Engine::BucketMutex, FastUniq::Engine::LockFree, FastUniq::Engine::Partitioned}) {
+                for (bool ordered: {false, true}) {
+                    FastUniq::Options options;
+                    options.engine = engine;
+                    options.ordered = ordered;
+                    options.fieldSeparator = separator;
+                    options.keyFields = keyFields;
+                    for (unsigned i = 1; i <= (unsigned)omp_get_num_procs(); i++) {
+                        std::vector<std::string> result = FastUniq::Uniquify(fileName, i, options);
+                        if (ordered ? result != expected : std::unordered_set<std::string>(result.begin(), result.end()) != expectedSet
+                            || result.size() != expected.size()) fail("Uniquify", i);
+                        result = FastUniq::Uniquify<FastUniq::Hash128>(fileName, i, options);
+                        if (result.size() != expected.size()) fail("Uniquify<Hash128>", i);
+                        if (FastUniq::UniquifyToStdout(fileName, i, options) != expected.size()) fail("UniquifyToStdout", i);
+                        if (FastUniq::CountDistinct(fileName, i, options) != expected.size()) fail("CountDistinct", i);
+                        KeyedApiTester(fileName, options, i, expected, counts, fail);
+                    }
+                }
+            }
+        }
+        std::remove(fileName);
+    }
+    fprintf(stderr, "\"Key fields\" passed\n");
+}
+
+// Deduplicating JSON Lines on key paths must keep the first line of each combination of
+// values. The lines are rendered from known values, in a random key order and with random
+// spacing, around decoys: the same keys nested elsewhere or in arrays, and strings holding
+// quotes, brackets and commas.
+void JsonKeyTester() {
+    std::mt19937 rng(1);
+    auto space = [&] { return std::string(rng() % 3 == 0 ? rng() % 3 : 0, ' '); };
+    std::vector<std::string> lines;
+    // Values of event_id, user.id and ts, or "" when the key is left out
+    std::vector<std::array<std::string, 3>> values;
+    for (unsigned i = 0; i < 20000; i++) {
+        std::array<std::string, 3> value = {
+            std::to_string(rng() % 300),
+            "\"u" + std::to_string(rng() % 20) + (rng() % 4 == 0 ? "\\\"q\\\\" : "") + "\"",
+            rng() % 2 ? "[1, {\"a\": 2}]" : std::to_string(rng() % 10)
+        };
+        for (auto &v: value) {
+            if (rng() % 10 == 0) v = "";
+        }
+        std::vector<std::string> members;
+        if (!value[0].empty()) members.push_back("\"event_id\":" + space() + value[0]);
+        std::string user = "{\"name\": \"n\"";
+        if (!value[1].empty()) user += "," + space() + "\"id\"" + space() + ":" + space() + value[1] + space();
+        members.push_back("\"user\":" + user + "}");
+        if (!value[2].empty()) members.push_back("\"ts\"" + space() + ":" + value[2]);
+        members.push_back("\"note\": \"\\\"event_id\\\": " + std::to_string(rng() % 1000) + ", {[\"");
+        members.push_back("\"list\": [{\"event_id\": " + std::to_string(rng() % 1000) + "}, \"id\"]");
+        members.push_back("\"meta\": {\"event_id\": " + std::to_string(rng() % 1000) + ", \"user\": {\"id\": 1}}");
+        std::shuffle(members.begin(), members.end(), rng);
+        std::string line = "{";
+        for (unsigned m = 0; m < members.size(); m++) {
+            line += (m > 0 ? "," + space() : space()) + members[m];
+        }
+        lines.push_back(line + space() + "}");
+        values.push_back(value);
+    }
+
+    char fileName[] = "/tmp/tempjsonXXXXXX";
+    close(mkstemp(fileName));
+    {
+        std::ofstream tmpFile(fileName);
+        for (auto &line: lines) tmpFile << line << "\n";
+    }
+
+    std::vector<std::pair<std::vector<std::string>, std::vector<unsigned>>> cases = {
+        {{"event_id"}, {0}}, {{"user.id", "ts"}, {1, 2}}, {{"ts", "event_id", "user.id"}, {2, 0, 1}}
+    };
+    for (auto &[jsonKeys, columns]: cases) {
+        std::map<std::vector<std::string>, unsigned> seen;
+        std::vector<std::string> expected;
+        std::vector<uint64_t> counts;
+        for (unsigned i = 0; i < lines.size(); i++) {
+            std::vector<std::string> key;
+            for (unsigned column: columns) key.push_back(values[i][column]);
+            auto [it, inserted] = seen.emplace(key, expected.size());
+            if (inserted) {
+                expected.push_back(lines[i]);
+                counts.push_back(0);
+            }
+            counts[it->second]++;
+        }
+
+        auto fail = [&](const char* api, unsigned threadNum) {
+            fprintf(stderr, "Test \"JSON keys\" failed! (%s, %s..., %u threads)\n", api, jsonKeys[0].data(), threadNum);
+            std::remove(fileName);
+            exit(1);
+        };
+        // The keys are hashed rather than compared, so the exact mode has no effect
+        for (FastUniq::Engine engine: {FastUniq::Engine::BucketMutex, FastUniq::Engine::Partitioned}) {
+            for (bool ordered: {false, true}) {
+                for (bool exact: {false, true}) {
+                    FastUniq::Options options;
+                    options.engine = engine;
+                    options.ordered = ordered;
+                    options.exact = exact;
+                    options.jsonKeys = jsonKeys;
+                    for (unsigned i = 1; i <= (unsigned)omp_get_num_procs(); i++) {
+                        std::vector<std::string> result = FastUniq::Uniquify(fileName, i, options);
+                        if (ordered ? result != expected : result.size() != expected.size()) fail("Uniquify", i);
+                        if (FastUniq::UniquifyToStdout<FastUniq::Hash128>(fileName, i, options) != expected.size()) {
+                            fail("UniquifyToStdout<Hash128>", i);
+                        }
+                        if (FastUniq::CountDistinct(fileName, i, options) != expected.size()) fail("CountDistinct", i);
+                        KeyedApiTester(fileName, options, i, expected, counts, fail);
+                    }
+                }
+            }
+        }
+    }
+    std::remove(fileName);
+    fprintf(stderr, "\"JSON keys\" passed\n");
+}
+
+// A truncated or corrupt seen-set file must be rejected with an error, not read out of
+// bounds or looped over forever. Each load runs in a child process, which must exit with 1.
+void SeenSetTester() {
+    using namespace FastUniq::Internal;
+    char inputName[] = "/tmp/tempfileXXXXXX";
+    close(mkstemp(inputName));
+    {
+        std::ofstream inputFile(inputName);
+        for (unsigned i = 0; i < 1000; i++) {
+            inputFile << i << "\n";
+        }
+    }
+    char seenName[] = "/tmp/tempseenXXXXXX";
+    close(mkstemp(seenName));
+    std::remove(seenName);
+    FastUniq::UniquifyAgainst(seenName, inputName, 1, true);
+    std::string valid;
+    {
+        std::ifstream seenFile(seenName);
+        valid.assign(std::istreambuf_iterator<char>(seenFile), std::istreambuf_iterator<char>());
+    }
+
+    auto bucketField = [](unsigned field) { return sizeof(SeenSetHeader) + field * sizeof(uint64_t); };
+    auto setU64 = [](std::string &bytes, uint64_t pos, uint64_t value) { memcpy(&bytes[pos], &value, sizeof(value)); };
+    auto getU64 = [](const std::string &bytes, uint64_t pos) { uint64_t value; memcpy(&value, &bytes[pos], sizeof(value)); return value; };
+    std::vector<std::pair<const char*, std::string>> corrupted;
+    corrupted.emplace_back("truncated", valid.substr(0, valid.size() / 2));
+    std::string bytes = valid;
+    setU64(bytes, bucketField(2), getU64(valid, bucketField(2)) + 1);
+    corrupted.emplace_back("wrong bucket size", bytes);
+    bytes = valid;
+    uint64_t offset = getU64(valid, bucketField(0)), capacity = getU64(valid, bucketField(1));
+    memset(&bytes[offset], 1, capacity * sizeof(uint64_t));
+    setU64(bytes, bucketField(2), capacity);
+    corrupted.emplace_back("full bucket", bytes);
+    // Loading does not read the slots, so this one is only caught by the lookups
+    bytes = valid;
+    memset(&bytes[offset], 1, capacity * sizeof(uint64_t));
+    corrupted.emplace_back("full bucket with the old size", bytes);
+    bytes = valid;
+    setU64(bytes, bucketField(0), 0);
+    corrupted.emplace_back("bucket over the header", bytes);
+    bytes = valid;
+    setU64(bytes, bucketField(1), 1ull << 62);
+    corrupted.emplace_back("huge bucket", bytes);
+    bytes = valid;
+    setU64(bytes, offsetof(SeenSetHeader, uniqueCount), getU64(valid, offsetof(SeenSetHeader, uniqueCount)) + 1);
+    corrupted.emplace_back("wrong unique count", bytes);
+
+    for (auto &[name, content]: corrupted) {
+        {
+            std::ofstream seenFile(seenName, std::ios::trunc);
+            seenFile << content;
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            int devNull = open("/dev/null", O_WRONLY);
+            dup2(devNull, STDERR_FILENO);
+            alarm(10);
+            FastUniq::UniquifyAgainst(seenName, inputName, 1);
+            _exit(0);
+        }
+        int status;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 1) {
+            fprintf(stderr, "Test \"Seen set\" failed! : %s file not rejected\n", name);
+            exit(1);
+        }
+    }
+    std::remove(seenName);
+    std::remove(inputName);
+    fprintf(stderr, "\"Seen set\" passed\n");
+}
+
+// The estimates must stay within 4 standard errors at every precision, including the
+// smallest ones whose bias correction differs
+void HyperLogLogTester() {
+    using namespace FastUniq::Internal;
+    std::mt19937_64 rng(1);
+    for (unsigned precision = HLL_MIN_PRECISION; precision <= HLL_MAX_PRECISION; precision += 2) {
+        for (unsigned distinct: {100u, 1000000u}) {
+            HyperLogLog sketch(precision);
+            for (unsigned i = 0; i < distinct; i++) {
+                sketch.Add(rng());
+            }
+            double error = 1.04 / std::sqrt((double)(1u << precision));
+            if (std::abs(sketch.Estimate() / distinct - 1) > 4 * error) {
+                fprintf(stderr, "Test \"HyperLogLog\" failed! : precision %u, %u distinct, estimate %.0f\n",
+                    precision, distinct, sketch.Estimate());
+                exit(1);
+            }
+        }
+    }
+    fprintf(stderr, "\"HyperLogLog\" passed\n");
+}
+
 // Test if FastUniq can handle edge cases
 int main() {
     Tester("Empty File", {});
@@ -45,4 +843,22 @@ int main() {
     Tester("Short strings", {"a", "a", "b", "bc", "c", "d", "d"});
     Tester("Short strings and empty strings", {"a", "", "", "a", "", "b", "b", ""});
     Tester("Strings and empty strings", {"string1", "", "", "string1", "", "string2", "string2", ""});
+
+    std::vector<std::string> many;
+    for (unsigned i = 0; i < 300000; i++) {
+        many.push_back(std::to_string(i % 200000));
+    }
+    Tester("Many unique strings", many);
+
+    // Longer than a block of UniquifyStream
+    std::string longLine(20 << 20, 'x');
+    Tester("Long lines", {"a", longLine, "b", longLine, longLine + "y", "a"});
+
+    UnterminatedTester();
+    CollisionTester();
+    KernelTester();
+    HyperLogLogTester();
+    SeenSetTester();
+    KeyFieldTester();
+    JsonKeyTester();
 }
\ No newline at end of file